@@ -1,127 +1,199 @@
+#include <algorithm>
 #include <atomic>
+#include <cassert>
 #include <iostream>
 #include <vector>
 #include <thread>
-#include <unordered_set>
 #include <mutex>
 #include <chrono>
 #include <random>
+#include <optional>
+#include <string>
 
 
 std::atomic<int> deleted(0);
 
 constexpr int THREAD_CNT = 8;
 
-template<typename T, int thread_cnt>
+template<typename T, int slot_cnt = 3>
 struct MemoryManager {
 private:
-    static std::mutex mut_;
-    static std::atomic<int> index_;
     using Ptr = T*;
 
-    static const int cycle_limit = thread_cnt + 1;
+    // Hazard records live in a lock-free list that only grows to the peak number of threads:
+    // a thread that exits deactivates its record and the next new thread reuses it
+    struct HazardRecord {
+        std::atomic<T*> protected_[slot_cnt] = {};
+        std::atomic<bool> active_{true};
+        HazardRecord* next = nullptr;
+    };
+
+    // Retired nodes a thread could not reclaim before exiting, adopted by the next scan of any thread
+    struct Orphans {
+        std::vector<T*> expired;
+        Orphans* next = nullptr;
+    };
+
+    static std::atomic<HazardRecord*> records_;
+    static std::atomic<int> record_cnt_;
+    static std::atomic<Orphans*> orphans_;
 
     static thread_local struct ThreadLocalManagement {
 
-        std::atomic<T*> protected_;
-        int cnt;
-        std::atomic<T*> expired_[thread_cnt + 1];
-        int idx;
-
-        ThreadLocalManagement() : protected_(nullptr), cnt(0) {
-            std::lock_guard<std::mutex> lock(MemoryManager::mut_);
-            idx = MemoryManager::index_.load();
-            MemoryManager::global_manager_[idx] = &protected_;
-            for (int i = 0; i < MemoryManager::cycle_limit; ++i) {
-                expired_[i].store(nullptr);
-            }
-            index_.fetch_add(1);
-        }
+        HazardRecord* record;
+        std::vector<T*> expired_;
+        std::vector<T*> hazards_;// sorted snapshot of all hazard pointers, reused by every scan
+
+        ThreadLocalManagement() : record(MemoryManager::acquire_record()) {}
 
         ~ThreadLocalManagement() {
-            global_manager_[idx] = nullptr;
+            MemoryManager::scan();
+            if (!expired_.empty()) {
+                auto* orphans = new Orphans{std::move(expired_)};
+                orphans->next = orphans_.load(std::memory_order_relaxed);
+                while (!orphans_.compare_exchange_weak(orphans->next, orphans, std::memory_order_release,
+                                                       std::memory_order_relaxed)) {
+                }
+            }
+            for (auto& slot : record->protected_) {
+                slot.store(nullptr);
+            }
+            record->active_.store(false, std::memory_order_release);
         }
 
     } local_management;
 
-
-    static std::atomic<T*>* global_manager_[];
-
-public:
-    static inline void retire(T* ptr) {
-
-        for (int i = 0; i < cycle_limit; ++i) {
-            if (local_management.expired_[i].load() == nullptr) {
-                local_management.expired_[i].store(ptr);
-                break;
+    static HazardRecord* acquire_record() {
+        for (HazardRecord* record = records_.load(std::memory_order_acquire); record; record = record->next) {
+            bool active = false;
+            if (!record->active_.load(std::memory_order_relaxed) &&
+                record->active_.compare_exchange_strong(active, true, std::memory_order_acquire)) {
+                return record;
             }
         }
 
-        ++local_management.cnt;
-
-        if (local_management.cnt > thread_cnt) {
-
-            std::vector<T*> set_of_expired;
-            std::unordered_set<T*> set_of_protected;
-            std::unordered_set<T*> pointers_to_delete;
-
+        auto* record = new HazardRecord;
+        record->next = records_.load(std::memory_order_relaxed);
+        while (!records_.compare_exchange_weak(record->next, record, std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+        }
+        record_cnt_.fetch_add(1, std::memory_order_relaxed);
+        return record;
+    }
 
-            for (int i = 0; i < cycle_limit; ++i) {
-                set_of_expired.push_back(local_management.expired_[i].load());
-            }
-            auto& index_copy = index_;
+    static void scan() {
+        // pairs with the seq_cst hazard store and reload in protect(): either that reload sees the nodes
+        // this thread unlinked before retiring them, or the loads below see the hazard
+        std::atomic_thread_fence(std::memory_order_seq_cst);
 
-            for (int i = 0; i < index_.load(); ++i) {
-                if (global_manager_[i]) {
-                    set_of_protected.insert(global_manager_[i]->load());
-                }
+        auto& expired = local_management.expired_;
 
-            }
+        for (Orphans* orphans = orphans_.exchange(nullptr, std::memory_order_acquire); orphans;) {
+            expired.insert(expired.end(), orphans->expired.begin(), orphans->expired.end());
+            Orphans* next = orphans->next;
+            delete orphans;
+            orphans = next;
+        }
 
-            for (auto& pointer: set_of_expired) {
-                if (set_of_protected.find(pointer) == set_of_protected.end()) {
-                    pointers_to_delete.insert(pointer);
+        auto& hazards = local_management.hazards_;
+        hazards.clear();
+        for (HazardRecord* record = records_.load(std::memory_order_acquire); record; record = record->next) {
+            for (auto& slot : record->protected_) {
+                if (T* pointer = slot.load()) {
+                    hazards.push_back(pointer);
                 }
             }
+        }
+        std::sort(hazards.begin(), hazards.end());
 
-            for (auto& pointer: pointers_to_delete) {
+        size_t kept = 0;
+        for (auto& pointer: expired) {
+            if (std::binary_search(hazards.begin(), hazards.end(), pointer)) {
+                expired[kept++] = pointer;
+            } else {
 //                deleted.fetch_add(1);
                 delete pointer;
             }
+        }
+        expired.resize(kept);
+    }
 
-            for (int i = 0; i < cycle_limit; ++i) {
-                if (pointers_to_delete.find(local_management.expired_[i].load()) != pointers_to_delete.end()) {
-                    local_management.expired_[i].store(nullptr);
-                    --local_management.cnt;
-                }
-            }
-
+public:
+    // Scans are batched: at most slot_cnt pointers per record can stay protected, so with
+    // 2 * records * slot_cnt retired nodes at least half of them are freed per scan
+    static inline void retire(T* ptr) {
+        auto& expired = local_management.expired_;
+        const size_t threshold = 2 * static_cast<size_t>(record_cnt_.load(std::memory_order_relaxed)) * slot_cnt;
+        if (expired.capacity() < threshold) {
+            expired.reserve(2 * threshold);
+            local_management.hazards_.reserve(threshold);
         }
+        expired.push_back(ptr);
 
+        if (expired.size() >= threshold) {
+            scan();
+        }
     }
 
-    static inline Ptr protect(Ptr ptr) {
-
-        local_management.protected_.store(ptr);
-        return local_management.protected_.load();
+    // Publishes the current value of source in the slot and rereads source until it is unchanged,
+    // so the returned pointer was still reachable after it became protected
+    static inline Ptr protect(const std::atomic<T*>& source, int slot = 0) {
+        assert(0 <= slot && slot < slot_cnt);
+        auto& hazard = local_management.record->protected_[slot];
+        Ptr ptr = source.load(std::memory_order_relaxed);
+        while (true) {
+            hazard.store(ptr);
+            Ptr current = source.load(std::memory_order_seq_cst);
+            if (current == ptr) {
+                return ptr;
+            }
+            ptr = current;
+        }
     }
 
-    static inline void release() {
-        local_management.protected_.store(nullptr);
+    static inline void release(int slot = 0) {
+        assert(0 <= slot && slot < slot_cnt);
+        local_management.record->protected_[slot].store(nullptr, std::memory_order_release);
     }
+
+    // Owns one slot and clears it when leaving the scope
+    class Guard {
+    public:
+        explicit Guard(int slot = 0) : slot_(slot) {
+            assert(0 <= slot && slot < slot_cnt);
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        ~Guard() {
+            release();
+        }
+
+        Ptr protect(const std::atomic<T*>& source) {
+            return MemoryManager::protect(source, slot_);
+        }
+
+        void release() {
+            MemoryManager::release(slot_);
+        }
+
+    private:
+        int slot_;
+    };
 };
 
-template<typename T, int thread_cnt>
+template<typename T, int slot_cnt>
 thread_local typename
-MemoryManager<T, thread_cnt>::ThreadLocalManagement MemoryManager<T, thread_cnt>::local_management;
+MemoryManager<T, slot_cnt>::ThreadLocalManagement MemoryManager<T, slot_cnt>::local_management;
 
-template<typename T, int thread_cnt> std::atomic<int> MemoryManager<T, thread_cnt>::index_(0);
+template<typename T, int slot_cnt>
+std::atomic<typename MemoryManager<T, slot_cnt>::HazardRecord*> MemoryManager<T, slot_cnt>::records_(nullptr);
 
-template<typename T, int thread_cnt>
-std::atomic<T*>* MemoryManager<T, thread_cnt>::global_manager_[thread_cnt];
+template<typename T, int slot_cnt> std::atomic<int> MemoryManager<T, slot_cnt>::record_cnt_(0);
 
-template<typename T, int thread_cnt>
-std::mutex MemoryManager<T, thread_cnt>::mut_;
+template<typename T, int slot_cnt>
+std::atomic<typename MemoryManager<T, slot_cnt>::Orphans*> MemoryManager<T, slot_cnt>::orphans_(nullptr);
 
 template<typename T>
 class LockFreeStack {
@@ -133,8 +205,10 @@ private:
         Node(const T& item) : data(item) {}
     };
 
-    MemoryManager<Node, THREAD_CNT> manager;
-    std::atomic<Node*> top_;
+    using Manager = MemoryManager<Node, 1>;
+
+    Manager manager;
+    std::atomic<Node*> top_{nullptr};
 
 
 public:
@@ -148,8 +222,9 @@ public:
     }
 
     std::optional<T> pop() {
+        typename Manager::Guard guard;
         while (true) {
-            Node* current_top = manager.protect(top_.load(std::memory_order_relaxed));
+            Node* current_top = guard.protect(top_);
 
 
             if (current_top == nullptr) {
@@ -158,7 +233,7 @@ public:
                                                   std::memory_order_relaxed)) {
 
                 T copy = current_top->data;
-                manager.release();
+                guard.release();
 
                 manager.retire(current_top);
                 return std::optional<T>(copy);
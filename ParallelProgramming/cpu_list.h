@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sched.h>
+
+// Ids from a sysfs list such as "0-3,8,10-11"
+inline std::vector<int> parse_id_list(const std::string& list) {
+    std::vector<int> ids;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = std::min(list.find(',', pos), list.size());
+        const char* stop = list.data() + end;
+        int first = 0;
+        auto [next, error] = std::from_chars(list.data() + pos, stop, first);
+        if (error == std::errc()) {
+            int last = first;
+            if (next != stop && *next == '-') {
+                std::from_chars(next + 1, stop, last);
+            }
+            for (int id = first; id <= last; ++id) {
+                ids.push_back(id);
+            }
+        }
+        pos = end + 1;
+    }
+    return ids;
+}
+
+// Command line list such as "1,2,4": plain numbers, each within [min, max]. Throws std::invalid_argument
+// naming the offending item, so a range such as "256-1024" or a 0 is an error rather than a guess
+inline std::vector<int> parse_int_list(const std::string& list, const int min, const int max) {
+    std::vector<int> items;
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t end = std::min(list.find(',', pos), list.size());
+        const std::string item = list.substr(pos, end - pos);
+        int value = 0;
+        auto [next, error] = std::from_chars(item.data(), item.data() + item.size(), value);
+        if (item.empty() || error != std::errc() || next != item.data() + item.size()) {
+            throw std::invalid_argument("not a number: \"" + item + "\"");
+        }
+        if (value < min || value > max) {
+            throw std::invalid_argument(item + " is outside [" + std::to_string(min) + ", " + std::to_string(max) + "]");
+        }
+        items.push_back(value);
+        pos = end + 1;
+    }
+    return items;
+}
+
+// NUMA nodes with the CPUs of each this process may run on, for matrix.cpp and lock.cpp alike.
+// Without sysfs node information the machine is one node holding every allowed CPU
+struct NumaTopology {
+    struct Node {
+        int id;
+        std::vector<int> cpus;
+    };
+
+    std::vector<Node> nodes;
+
+    static const NumaTopology& get() {
+        static const NumaTopology topology = discover();
+        return topology;
+    }
+
+    // allowed CPUs node after node, so neighbouring indices share a node
+    std::vector<int> cpu_order() const {
+        std::vector<int> order;
+        for (auto& node : nodes) {
+            order.insert(order.end(), node.cpus.begin(), node.cpus.end());
+        }
+        return order;
+    }
+
+private:
+    static NumaTopology discover() {
+        std::vector<int> allowed;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &set)) {
+                    allowed.push_back(cpu);
+                }
+            }
+        }
+#endif
+        if (allowed.empty()) {
+            for (int cpu = 0; cpu < static_cast<int>(std::max(1u, std::thread::hardware_concurrency())); ++cpu) {
+                allowed.push_back(cpu);
+            }
+        }
+
+        NumaTopology topology;
+        std::string line;
+        std::ifstream online("/sys/devices/system/node/online");
+        if (std::getline(online, line)) {
+            for (int id : parse_id_list(line)) {
+                std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+                std::string cpus;
+                std::getline(cpulist, cpus);
+
+                Node node{id, {}};
+                for (int cpu : parse_id_list(cpus)) {
+                    if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+                        node.cpus.push_back(cpu);
+                    }
+                }
+                if (!node.cpus.empty()) {
+                    topology.nodes.push_back(std::move(node));
+                }
+            }
+        }
+        if (topology.nodes.empty()) {
+            topology.nodes.push_back({0, allowed});
+        }
+        return topology;
+    }
+};
@@ -2,61 +2,379 @@
 // Created by artemiy on 17.04.2021.
 //
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <vector>
 #include <iostream>
 #include <cassert>
 #include <climits>
+#include <cstdint>
+#include <functional>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
-class Timer {
-public:
-    Timer() {
-        begin = std::chrono::steady_clock::now();
+#include "cpu_list.h"
+
+// Spin-wait hint: pause on x86, yield on ARM
+inline void cpu_relax() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __asm volatile ("pause");
+#elif defined(__GNUC__) && defined(__aarch64__)
+    __asm volatile ("yield");
+#endif
+}
+
+// How long one cpu_relax() takes here, measured once at startup. Backoff limits are given in
+// nanoseconds and turned into pause counts with it: a pause is ~10 cycles on Skylake client
+// cores and ~140 on Skylake-SP and later, the same count would mean very different waits
+struct PauseCalibration {
+    double pause_ns;
+
+    static const PauseCalibration& get() {
+        static const PauseCalibration calibration = measure();
+        return calibration;
+    }
+
+    int pauses(const double ns) const {
+        return std::max(1, static_cast<int>(ns / pause_ns));
     }
 
-    ~Timer() {
-        auto end = std::chrono::steady_clock::now();
-        auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin);
-        std::cout << elapsed_ms.count() << " ms" << std::endl;
+private:
+    static PauseCalibration measure() {
+        constexpr int rounds = 5;
+        constexpr int pauses_per_round = 2000;
+        double best = 1e9;
+        for (int round = 0; round < rounds; ++round) {
+            auto begin = std::chrono::steady_clock::now();
+            for (int i = 0; i < pauses_per_round; ++i) {
+                cpu_relax();
+            }
+            std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - begin;
+            best = std::min(best, elapsed.count() / pauses_per_round);
+        }
+        return {std::max(best, 0.1)};
+    }
+};
+
+static const PauseCalibration& pause_calibration = PauseCalibration::get();
+
+// xorshift32, per thread, for backoff jitter
+inline uint32_t backoff_random() {
+    static thread_local uint32_t state =
+            static_cast<uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Backoff policies, one object per acquisition: backoff(ahead) is called after every failed look at
+// the lock, ahead is how many waiters are known to be in front (1 when the lock cannot tell).
+
+// Random wait below a bound that doubles from min_ns up to max_ns, so waiters that failed together
+// spread out. At the bound the waiter also yields, the holder may be descheduled
+class ExponentialBackoff {
+public:
+    static constexpr double min_ns = 100;
+    static constexpr double max_ns = 20000;
+
+    void operator()(unsigned = 1) {
+        static const int min_pauses = pause_calibration.pauses(min_ns);
+        static const int max_pauses = pause_calibration.pauses(max_ns);
+
+        if (limit == 0) {
+            limit = min_pauses;
+        }
+        for (int i = static_cast<int>(backoff_random() % limit); i >= 0; --i) {
+            cpu_relax();
+        }
+        if (limit < max_pauses) {
+            limit = std::min(2 * limit, max_pauses);
+        } else {
+            std::this_thread::yield();
+        }
     }
 
 private:
-    std::chrono::time_point<std::chrono::_V2::steady_clock, std::chrono::duration<long int, std::ratio<1, 1000000000>>>
-            begin;
+    int limit = 0;
+};
+
+// For queue locks that know their position: wait about as long as the handoffs in front take.
+// A queue longer than there are CPUs means some waiters are not running, so yield instead
+class ProportionalBackoff {
+public:
+    static constexpr double handoff_ns = 200;
 
+    void operator()(const unsigned ahead = 1) {
+        static const int per_waiter = pause_calibration.pauses(handoff_ns);
+        static const unsigned cpu_cnt = std::max(1u, std::thread::hardware_concurrency());
 
+        if (ahead > cpu_cnt) {
+            std::this_thread::yield();
+            return;
+        }
+        for (int i = static_cast<int>(ahead) * per_waiter; i > 0; --i) {
+            cpu_relax();
+        }
+    }
 };
 
-struct Backoff {
+// For waiters that poll a flag of their own: one pause per look, so a handoff is seen at once, until
+// spinning has taken about as long as a context switch. From then on the waiter yields on every look,
+// the holder or the thread the lock is handed to may be waiting for this CPU
+class SpinThenYield {
 public:
-    inline void operator()() {
-#ifdef __GNUC__
-        __asm volatile ("pause");
-#endif
-        if (++iteration_num == limit) {
-#ifdef __GNUC__
-            __asm volatile ("pause");
-#endif
-            iteration_num = 0;
-            limit = (limit >= min) ? limit * 100 / 85 : min;
+    static constexpr double spin_ns = 20000;
+
+    void operator()(unsigned = 1) {
+        static const int max_spins = pause_calibration.pauses(spin_ns);
+
+        if (spins < max_spins) {
+            ++spins;
+            cpu_relax();
+        } else {
             std::this_thread::yield();
         }
+    }
 
-#ifdef __GNUC__
-        __asm volatile ("pause");
+private:
+    int spins = 0;
+};
+
+// Plain spinning, one pause per look
+class NoBackoff {
+public:
+    void operator()(unsigned = 1) {
+        cpu_relax();
+    }
+};
+
+// Index of the calling thread, handed out in order of first use
+inline size_t thread_slot() {
+    static std::atomic<size_t> next_slot(0);
+    static thread_local const size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+}
+
+// What a profiled lock has recorded. Histogram bucket b counts waits or holds of [2^b, 2^(b+1)) ticks,
+// bucket_ns() converts the bounds
+struct LockSnapshot {
+    static constexpr int buckets = 48;
+
+    uint64_t acquisitions = 0;
+    uint64_t contended = 0;// acquisitions that had to wait at all
+    uint64_t spins = 0;// backoff rounds over all contended acquisitions
+    uint64_t wait[buckets] = {};
+    uint64_t hold[buckets] = {};// exclusive acquisitions only
+    double ns_per_tick = 1;
+
+    double bucket_ns(const int bucket) const {
+        return static_cast<double>(uint64_t(1) << bucket) * ns_per_tick;
+    }
+
+    void write_json(std::ostream& out) const {
+        auto histogram = [&](const char* name, const uint64_t* counts) {
+            out << ",\"" << name << "\":[";
+            for (int b = 0, first = 1; b < buckets; ++b) {
+                if (counts[b]) {
+                    out << (first ? "" : ",") << "[" << bucket_ns(b) << "," << counts[b] << "]";
+                    first = 0;
+                }
+            }
+            out << "]";
+        };
+        out << "{\"acquisitions\":" << acquisitions << ",\"contended\":" << contended << ",\"spins\":" << spins;
+        histogram("wait_ns", wait);
+        histogram("hold_ns", hold);
+        out << "}";
+    }
+};
+
+// Timestamps for profiling and benchmarks: TSC on x86, nanoseconds elsewhere
+inline uint64_t profile_ticks() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
 #endif
+}
+
+inline double ns_per_tick() {
+    static const double rate = [] {
+        auto begin = std::chrono::steady_clock::now();
+        uint64_t first = profile_ticks();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        uint64_t last = profile_ticks();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - begin;
+        return last > first ? elapsed.count() / static_cast<double>(last - first) : 1.0;
+    }();
+    return rate;
+}
+
+#ifdef LOCK_PROFILING
+
+// Counters of a lock, sharded by thread so recording stays on a line the thread mostly owns;
+// snapshot() merges the shards
+class LockProfile {
+public:
+    static constexpr bool profiled = true;
+
+    LockSnapshot snapshot() const {
+        LockSnapshot result;
+        for (size_t i = 0; i < shard_cnt; ++i) {
+            const Shard& shard = shards[i];
+            result.acquisitions += shard.acquisitions.load(std::memory_order_relaxed);
+            result.contended += shard.contended.load(std::memory_order_relaxed);
+            result.spins += shard.spins.load(std::memory_order_relaxed);
+            for (int b = 0; b < LockSnapshot::buckets; ++b) {
+                result.wait[b] += shard.wait[b].load(std::memory_order_relaxed);
+                result.hold[b] += shard.hold[b].load(std::memory_order_relaxed);
+            }
+        }
+        result.ns_per_tick = ns_per_tick();
+        return result;
+    }
+
+protected:
+    // one per acquisition, the clock is read only once the acquisition turns out to be contended
+    struct Probe {
+        uint64_t start = 0;
+        uint64_t spins = 0;
+
+        void spin() {
+            if (spins++ == 0) {
+                start = profile_ticks();
+            }
+        }
+    };
+
+    Probe begin_acquire() const {
+        return {};
+    }
+
+    void acquired(const Probe& probe) {
+        acquired_shared(probe);
+        acquired_at = profile_ticks();
+    }
+
+    void acquired_shared(const Probe& probe) {
+        waited_until(probe, probe.spins ? profile_ticks() : 0);
+    }
+
+    // Delegating locks run a critical section on another thread than the one that asked for it:
+    // the runner brackets it with entered() and released(), the asker records its wait up to entered()
+    uint64_t entered() {
+        return acquired_at = profile_ticks();
+    }
+
+    void waited_until(const Probe& probe, const uint64_t at) {
+        Shard& shard = local_shard();
+        shard.acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if (probe.spins) {
+            shard.contended.fetch_add(1, std::memory_order_relaxed);
+            shard.spins.fetch_add(probe.spins, std::memory_order_relaxed);
+            // a delegated section may have started before the asker first looked again
+            shard.wait[bucket(at > probe.start ? at - probe.start : 0)].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // called by the holder before it lets go
+    void released() {
+        local_shard().hold[bucket(profile_ticks() - acquired_at)].fetch_add(1, std::memory_order_relaxed);
     }
 
 private:
-    int min = 45000;
-    int limit = 100'000;
-    int iteration_num = 0;
+    static constexpr size_t shard_cnt = 16;
+
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> acquisitions{0};
+        std::atomic<uint64_t> contended{0};
+        std::atomic<uint64_t> spins{0};
+        std::atomic<uint64_t> wait[LockSnapshot::buckets] = {};
+        std::atomic<uint64_t> hold[LockSnapshot::buckets] = {};
+    };
+
+    std::unique_ptr<Shard[]> shards{new Shard[shard_cnt]};
+    uint64_t acquired_at = 0;// holder only
+
+    Shard& local_shard() {
+        return shards[thread_slot() % shard_cnt];
+    }
+
+    static int bucket(const uint64_t ticks) {
+#ifdef __GNUC__
+        int log = 63 - __builtin_clzll(ticks | 1);
+#else
+        int log = 0;
+        for (uint64_t rest = ticks; rest >>= 1;) {
+            ++log;
+        }
+#endif
+        return std::min(log, LockSnapshot::buckets - 1);
+    }
 };
 
-class TTAS {
+#else
+
+// Profiling compiled out: an empty base, every hook inlines to nothing
+class LockProfile {
+public:
+    static constexpr bool profiled = false;
+
+    LockSnapshot snapshot() const {
+        return {};
+    }
+
+protected:
+    struct Probe {
+        void spin() {}
+    };
+
+    Probe begin_acquire() const {
+        return {};
+    }
+
+    void acquired(const Probe&) {}
+
+    void acquired_shared(const Probe&) {}
+
+    uint64_t entered() {
+        return 0;
+    }
+
+    void waited_until(const Probe&, uint64_t) {}
+
+    void released() {}
+};
+
+#endif
+
+template<typename Backoff = ExponentialBackoff>
+class TTAS : public LockProfile {
 private:
     std::atomic<bool> locked;
 
@@ -65,28 +383,37 @@ public:
 
     void lock() {
 
+        Probe probe = begin_acquire();
         bool flag = false;
         Backoff backoff;
 
         do {
 
-//            flag = false;
+            flag = false; // a failed CAS leaves true here
 
             while (locked.load(std::memory_order_relaxed)) {
+                probe.spin();
                 backoff();
             }// wait
 
 
         } while (!locked.compare_exchange_weak(flag, true, std::memory_order_acquire, std::memory_order_relaxed));
 
+        acquired(probe);
     }
 
     void unlock() {
+        released();
         locked.store(false, std::memory_order_release);
     }
 };
 
-class TAS {
+#ifndef LOCK_PROFILING
+static_assert(sizeof(TTAS<>) == sizeof(std::atomic<bool>), "compiled out profiling must not take space");
+#endif
+
+template<typename Backoff = ExponentialBackoff>
+class TAS : public LockProfile {
 private:
     std::atomic<bool> locked;
 
@@ -95,272 +422,1040 @@ public:
 
     void lock() {
 
+        Probe probe = begin_acquire();
         bool flag = false;
         Backoff backoff;
 
         while (!locked.compare_exchange_weak(flag, true, std::memory_order_acquire, std::memory_order_relaxed)) {
+            flag = false;
+            probe.spin();
             backoff();
         }
 
+        acquired(probe);
     }
 
     void unlock() {
+        released();
         locked.store(false, std::memory_order_release);
     }
 };
 
 
-class TicketLock {
+template<typename Backoff = ProportionalBackoff>
+class TicketLock : public LockProfile {
 private:
     std::atomic<unsigned int> current_ticket;
     std::atomic<unsigned int> next_ticket;
 
 
 public:
+    TicketLock() : current_ticket(0), next_ticket(0) {}
+
     void lock() {
+        Probe probe = begin_acquire();
         const unsigned my_ticket = next_ticket.fetch_add(1, std::memory_order_relaxed);
         Backoff backoff;
-        while (current_ticket.load(std::memory_order_relaxed) != my_ticket) {
-            backoff();
+        unsigned current;
+        while ((current = current_ticket.load(std::memory_order_relaxed)) != my_ticket) {
+            probe.spin();
+            backoff(my_ticket - current);
         }
         current_ticket.load(std::memory_order_acquire);
+        acquired(probe);
     }
 
     void unlock() {
+        released();
 
         const unsigned next = current_ticket.load(std::memory_order_relaxed) + 1;
         current_ticket.store(next, std::memory_order_release);
 
         //current_ticket.fetch_add(1, std::memory_order_release);
     }
-};
 
+    // only meaningful to the holder: someone has taken a ticket after it
+    bool has_waiters() const {
+        return next_ticket.load(std::memory_order_relaxed) - current_ticket.load(std::memory_order_relaxed) > 1;
+    }
+};
 
-template<typename Lock=TTAS>
-class Tester {
+// Spins like TTAS for a while, then sleeps in the kernel until the holder wakes it.
+// The spin budget follows how long recent spin acquisitions had to spin, and halves every time
+// spinning gives up, so a lock whose holder is usually gone quickly keeps spinning and one that
+// is held long parks early
+class FutexLock : public LockProfile {
 private:
-    const int thread_cnt = 100;
-    Lock lock;
+    static constexpr double max_spin_ns = 20000;// about what parking and waking again costs
+
+    std::atomic<int> state;// 0 free, 1 held, 2 held and waiters may be asleep
+    std::atomic<int> spin_estimate;
+
+    void wait(const int expected) {
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<int*>(&state), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    void wake_one() {
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<int*>(&state), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+    }
+
+    // moving average over about 8 acquisitions that got the lock by spinning
+    void spin_succeeded(const int spins) {
+        int estimate = spin_estimate.load(std::memory_order_relaxed);
+        spin_estimate.store(estimate + (spins - estimate) / 8, std::memory_order_relaxed);
+    }
+
+    void spin_failed() {
+        spin_estimate.store(spin_estimate.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+    }
 
 public:
+    FutexLock() : state(0), spin_estimate(100) {}
 
+    void lock() {
+        Probe probe = begin_acquire();
+        int expected = 0;
+        if (state.compare_exchange_strong(expected, 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+            acquired(probe);
+            return;
+        }
 
-    void test1() {
+        static const int max_spins = pause_calibration.pauses(max_spin_ns);
+        const int limit = std::min(max_spins, 2 * spin_estimate.load(std::memory_order_relaxed) + 10);
+        for (int spins = 0; spins < limit; ++spins) {
+            probe.spin();
+            cpu_relax();
+            if (state.load(std::memory_order_relaxed) == 0) {
+                expected = 0;
+                if (state.compare_exchange_weak(expected, 1, std::memory_order_acquire,
+                                                std::memory_order_relaxed)) {
+                    spin_succeeded(spins);
+                    acquired(probe);
+                    return;
+                }
+            }
+        }
+        spin_failed();
 
-        using namespace std::chrono;
-        using time_point = time_point<std::chrono::steady_clock>;
+        // whoever takes the lock from here on leaves it marked as possibly contended
+        while (state.exchange(2, std::memory_order_acquire) != 0) {
+            probe.spin();
+            wait(2);
+        }
+        acquired(probe);
+    }
 
+    void unlock() {
+        released();
+        if (state.exchange(0, std::memory_order_release) == 2) {
+            wake_one();
+        }
+    }
+};
 
-        for (int thread_cnt = 1; thread_cnt < 9; ++thread_cnt) {
 
-            Timer* t = new Timer;
+// Free list of queue nodes kept by every thread, so taking a queue lock does not allocate
+// and a thread may hold any number of them at once
+template<typename Node>
+class NodeCache {
+private:
+    Node* head = nullptr;
 
-            int i = 0;
-            const long long limit = 1000000;
-            std::vector<std::vector<std::pair<time_point, time_point>>> vec(thread_cnt);
+public:
+    ~NodeCache() {
+        while (head) {
+            delete std::exchange(head, head->free_next);
+        }
+    }
 
-            auto task = [&](int num) {
-                steady_clock clock;
-                while (true) {
+    Node* get() {
+        if (!head) {
+            return new Node;
+        }
+        return std::exchange(head, head->free_next);
+    }
 
-                    auto knock = clock.now();
-                    std::lock_guard<Lock> _lock(lock);
-                    auto enter = clock.now();
-                    vec[num].push_back(std::make_pair(knock, enter));
-                    if (i < limit) {
-                        ++i;
-                    } else {
-                        break;
-                    }
+    void put(Node* node) {
+        node->free_next = head;
+        head = node;
+    }
 
-                }
-            };
+    static NodeCache& local() {
+        static thread_local NodeCache cache;
+        return cache;
+    }
+};
 
-            std::vector<std::thread> workers(thread_cnt);
 
-            for (int i = 0; i < thread_cnt; ++i) {
-                workers[i] = std::thread(task, i);
+// Waiters queue up and each spins on the flag in its own node,
+// the holder hands the lock over by clearing its successor's flag.
+// Nobody else polls that flag, so waiters spin without backing off, and yield once a handoff is overdue
+template<typename Backoff = SpinThenYield>
+class MCSLock : public LockProfile {
+private:
+    struct alignas(64) Node {
+        std::atomic<Node*> next;
+        std::atomic<bool> locked;
+        Node* free_next = nullptr;
+    };
+
+    std::atomic<Node*> tail;
+    Node* holder = nullptr;// written and read only by whoever holds the lock
+
+public:
+    MCSLock() : tail(nullptr) {}
+
+    void lock() {
+        Probe probe = begin_acquire();
+        Node* node = NodeCache<Node>::local().get();
+        node->next.store(nullptr, std::memory_order_relaxed);
+        node->locked.store(true, std::memory_order_relaxed);
+
+        Node* prev = tail.exchange(node, std::memory_order_acq_rel);
+        if (prev) {
+            prev->next.store(node, std::memory_order_release);
+            Backoff backoff;
+            while (node->locked.load(std::memory_order_acquire)) {
+                probe.spin();
+                backoff();
             }
+        }
+        holder = node;
+        acquired(probe);
+    }
 
-            for (auto& worker : workers) {
-                if (worker.joinable()) {
-                    worker.join();
-                }
+    void unlock() {
+        released();
+        Node* node = holder;
+        Node* next = node->next.load(std::memory_order_acquire);
+        if (!next) {
+            Node* expected = node;
+            if (tail.compare_exchange_strong(expected, nullptr, std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+                NodeCache<Node>::local().put(node);
+                return;
             }
+            // a waiter has swapped the tail but not linked itself yet, which takes a few instructions
+            // unless it was preempted in between
+            SpinThenYield backoff;
+            while (!(next = node->next.load(std::memory_order_acquire))) {
+                backoff();
+            }
+        }
+        next->locked.store(false, std::memory_order_release);
+        NodeCache<Node>::local().put(node);
+    }
+
+    // only meaningful to the holder
+    bool has_waiters() const {
+        return holder->next.load(std::memory_order_relaxed) || tail.load(std::memory_order_relaxed) != holder;
+    }
+};
 
-            std::cout << thread_cnt << " threads\n";
-            std::cout << "time elapsed" << std::endl;
-            delete t;
 
-            assert(i == limit);
+// Waiters spin on the flag of the node queued before theirs. A released node still has its successor
+// spinning on it, so the unlocking thread keeps its predecessor's node instead.
+// Like MCS every waiter polls a flag of its own, so it spins and only yields once a handoff is overdue
+template<typename Backoff = SpinThenYield>
+class CLHLock : public LockProfile {
+private:
+    struct alignas(64) Node {
+        std::atomic<bool> locked;
+        Node* free_next = nullptr;
+    };
 
-            double avg;
-            int cnt = 0;
-            for (auto& arr: vec) {
-                for (auto& item: arr) {
-                    ++cnt;
-                    avg += duration_cast<milliseconds>(item.second - item.first).count();
-                }
-            }
+    std::atomic<Node*> tail;
+    Node* holder = nullptr;
+    Node* holder_prev = nullptr;
 
-            std::cout << "avg = " << avg / static_cast<double>(cnt) << std::endl <<std::endl;
+public:
+    CLHLock() : tail(new Node) {
+        tail.load(std::memory_order_relaxed)->locked.store(false, std::memory_order_relaxed);
+    }
 
-        }
+    CLHLock(const CLHLock&) = delete;
+
+    CLHLock& operator=(const CLHLock&) = delete;
 
+    ~CLHLock() {
+        delete tail.load(std::memory_order_relaxed);
+    }
+
+    void lock() {
+        Probe probe = begin_acquire();
+        Node* node = NodeCache<Node>::local().get();
+        node->locked.store(true, std::memory_order_relaxed);
 
-    } // test if lock works correctly
+        Node* prev = tail.exchange(node, std::memory_order_acq_rel);
+        Backoff backoff;
+        while (prev->locked.load(std::memory_order_acquire)) {
+            probe.spin();
+            backoff();
+        }
+        holder = node;
+        holder_prev = prev;
+        acquired(probe);
+    }
 
-    /*
-    void test2() {
-        using namespace std::chrono;
+    void unlock() {
+        released();
+        Node* prev = holder_prev;
+        holder->locked.store(false, std::memory_order_release);
+        NodeCache<Node>::local().put(prev);
+    }
+};
 
-        using time_point = time_point<std::chrono::steady_clock>;
 
-        std::chrono::steady_clock clock;
+// Phase-fair ticket reader-writer lock (Brandenburg and Anderson): readers and writers take turns,
+// a writer waits for at most one reader phase and readers for at most one writer.
+// Writers queue on win/wout; rin/rout count readers in steps of reader_step and the low
+// bits of rin tell arriving readers whether a writer, and of which phase, is present
+template<typename Backoff = ExponentialBackoff>
+class PhaseFairRWLock : public LockProfile {
+private:
+    static constexpr unsigned reader_step = 0x100;
+    static constexpr unsigned writer_bits = 0x3;
+    static constexpr unsigned writer_present = 0x2;
+    static constexpr unsigned phase_id = 0x1;
 
-        std::vector<std::vector<std::pair<time_point, time_point>>> vec(thread_cnt);
+    alignas(64) std::atomic<unsigned> rin;
+    alignas(64) std::atomic<unsigned> rout;
+    alignas(64) std::atomic<unsigned> win;
+    alignas(64) std::atomic<unsigned> wout;
 
-        auto task = [&](int num) {
-            for (int i = 0; i < 2; ++i) {
-//                int my_moment_of_request = clock();
-                auto knock = clock.now();
-                std::lock_guard<TTAS> _lock(lock);
-                auto enter = clock.now();
-                vec[num].push_back(std::make_pair(knock, enter));
+public:
+    PhaseFairRWLock() : rin(0), rout(0), win(0), wout(0) {}
+
+    void lock_shared() {
+        Probe probe = begin_acquire();
+        const unsigned writer = rin.fetch_add(reader_step, std::memory_order_acquire) & writer_bits;
+        if (writer != 0) {
+            Backoff backoff;
+            // blocked only until this writer's phase is over
+            while ((rin.load(std::memory_order_acquire) & writer_bits) == writer) {
+                probe.spin();
+                backoff();
             }
-        };
-
+        }
+        acquired_shared(probe);
+    }
 
-        std::vector<std::thread> workers(thread_cnt);
+    void unlock_shared() {
+        rout.fetch_add(reader_step, std::memory_order_release);
+    }
 
+    void lock() {
+        Probe probe = begin_acquire();
+        const unsigned ticket = win.fetch_add(1, std::memory_order_relaxed);
+        Backoff backoff;
+        while (wout.load(std::memory_order_acquire) != ticket) {
+            probe.spin();
+            backoff();
+        }
 
-        for (int i = 0; i < thread_cnt; ++i) {
-            workers[i] = std::thread(task, i);
+        // stop new readers, then wait for the ones already in
+        const unsigned readers = rin.fetch_add(writer_present | (ticket & phase_id), std::memory_order_acquire);
+        while (rout.load(std::memory_order_acquire) != readers) {
+            probe.spin();
+            backoff();
         }
+        acquired(probe);
+    }
 
-        for (auto& worker : workers) {
-            if (worker.joinable()) {
-                worker.join();
+    void unlock() {
+        released();
+        rin.fetch_and(~writer_bits, std::memory_order_release);
+        wout.fetch_add(1, std::memory_order_release);
+    }
+};
+
+
+// Big-reader lock: a reader count per shard, each on its own cache line, so readers on different
+// cores never write the same line. A writer raises a flag and waits for every shard to drain
+template<typename Backoff = ExponentialBackoff>
+class BigReaderLock : public LockProfile {
+private:
+    struct alignas(64) Shard {
+        std::atomic<int> readers{0};
+    };
+
+    const size_t shard_cnt;
+    std::unique_ptr<Shard[]> shards;
+    alignas(64) std::atomic<bool> writer;
+    TTAS<Backoff> writers;
+
+    // threads keep their shard for life, so unlock_shared finds the one lock_shared used
+    Shard& local_shard() {
+        return shards[thread_slot() % shard_cnt];
+    }
+
+public:
+    explicit BigReaderLock(const size_t shard_cnt = std::max(1u, std::thread::hardware_concurrency())) :
+            shard_cnt(std::max<size_t>(1, shard_cnt)),
+            shards(new Shard[this->shard_cnt]),
+            writer(false) {}
+
+    void lock_shared() {
+        Probe probe = begin_acquire();
+        Shard& shard = local_shard();
+        while (true) {
+            // seq_cst on both sides: either the writer sees this reader or the reader sees the writer
+            shard.readers.fetch_add(1, std::memory_order_seq_cst);
+            if (!writer.load(std::memory_order_seq_cst)) {
+                acquired_shared(probe);
+                return;
+            }
+            shard.readers.fetch_sub(1, std::memory_order_release);
+            Backoff backoff;
+            while (writer.load(std::memory_order_relaxed)) {
+                probe.spin();
+                backoff();
             }
         }
+    }
 
-//        for (int i = 0; i < thread_cnt; ++i) {
-//            std::cout << "thread " << i << std::endl;
-//            for (auto& item: vec[i]) {
-//                std::cout << "I requested lock at " << item.first.time_since_epoch() << " and got lock at "
-//                          << item.second << std::endl;
-//            }
-//        }
+    void unlock_shared() {
+        local_shard().readers.fetch_sub(1, std::memory_order_release);
+    }
 
-    }// show fairness/unfairness
-     */
+    void lock() {
+        Probe probe = begin_acquire();
+        writers.lock();
+        writer.store(true, std::memory_order_seq_cst);
+        Backoff backoff;
+        for (size_t i = 0; i < shard_cnt; ++i) {
+            while (shards[i].readers.load(std::memory_order_seq_cst) != 0) {
+                probe.spin();
+                backoff();
+            }
+        }
+        acquired(probe);
+    }
+
+    void unlock() {
+        released();
+        writer.store(false, std::memory_order_release);
+        writers.unlock();
+    }
+};
 
 
+// NUMA node of every CPU this process may run on, see NumaTopology
+struct NumaNodes {
+    std::vector<int> node_of_cpu;
+    int node_cnt = 1;
 
-    void test3() {
+    static const NumaNodes& get() {
+        static const NumaNodes nodes = discover();
+        return nodes;
+    }
 
-        using namespace std::chrono;
-        using time_point = time_point<std::chrono::steady_clock>;
+    // node of the CPU the calling thread runs on right now
+    static int current() {
+#ifdef __linux__
+        const auto& nodes = get();
+        int cpu = sched_getcpu();
+        if (cpu >= 0 && cpu < static_cast<int>(nodes.node_of_cpu.size())) {
+            return nodes.node_of_cpu[cpu];
+        }
+#endif
+        return 0;
+    }
 
+private:
+    static NumaNodes discover() {
+        NumaNodes nodes;
+        for (auto& node : NumaTopology::get().nodes) {
+            for (int cpu : node.cpus) {
+                if (cpu >= static_cast<int>(nodes.node_of_cpu.size())) {
+                    nodes.node_of_cpu.resize(cpu + 1, 0);
+                }
+                nodes.node_of_cpu[cpu] = node.id;
+            }
+            nodes.node_cnt = std::max(nodes.node_cnt, node.id + 1);
+        }
+        return nodes;
+    }
+};
 
-        for (int thread_cnt = 100; thread_cnt < 110; ++thread_cnt) {
 
-            std::vector<std::vector<std::pair<time_point, time_point>>> vec(thread_cnt);
-            Timer* t = new Timer;
+// Cohort lock (Dice, Marathe, Shavit): a global lock plus a local lock per NUMA node. The owner of
+// a local lock passes it to a waiter from its own node together with the global lock, up to
+// pass_limit times in a row, so the lock and the data it guards mostly stay on one socket.
+// Global must tolerate release by another thread than the one that acquired it (TicketLock, TTAS),
+// Local must tell its holder whether anyone waits (TicketLock, MCSLock). Both bring their own backoff,
+// and profile their own rounds. The cohort's profile counts an acquisition as contended when it found its
+// node's lock taken or the global lock owned by another node, and one spin for each of the two
+template<typename Global = TicketLock<>, typename Local = TicketLock<>>
+class CohortLock : public LockProfile {
+private:
+    struct alignas(64) Cohort {
+        Local local;
+        bool owns_global = false;// these two are guarded by local
+        int passes = 0;
+        std::atomic<int> present{0};// threads holding or waiting for local, kept only when profiled
+    };
+
+    Global global;
+    std::atomic<Cohort*> global_owner{nullptr};// kept only when profiled
+    const int pass_limit;
+    const int cohort_cnt;
+    std::unique_ptr<Cohort[]> cohorts;
+    Cohort* holder = nullptr;
 
-            auto task = [&](int num) {
-                steady_clock clock;
+public:
+    explicit CohortLock(const int pass_limit = 64) :
+            pass_limit(std::max(1, pass_limit)),
+            cohort_cnt(NumaNodes::get().node_cnt),
+            cohorts(new Cohort[cohort_cnt]) {}
 
-                for (int i = 0; i < 10; ++i) {
-                    auto knock = clock.now();
-                    std::lock_guard<Lock> _lock(lock);
-                    auto enter = clock.now();
-                    vec[num].push_back(std::make_pair(knock, enter));
-                    for (int j = 0; j < 1000; ++j);
+    void lock() {
+        Probe probe = begin_acquire();
+        Cohort& cohort = cohorts[NumaNodes::current() % cohort_cnt];
+        if constexpr (profiled) {
+            if (cohort.present.fetch_add(1, std::memory_order_relaxed) != 0) {
+                probe.spin();
+            }
+        }
+        cohort.local.lock();
+        if (!cohort.owns_global) {
+            if constexpr (profiled) {
+                if (global_owner.load(std::memory_order_relaxed)) {
+                    probe.spin();
                 }
+            }
+            global.lock();
+            if constexpr (profiled) {
+                global_owner.store(&cohort, std::memory_order_relaxed);
+            }
+            cohort.owns_global = true;
+        }
+        holder = &cohort;
+        acquired(probe);
+    }
 
-            };
+    void unlock() {
+        released();
+        Cohort& cohort = *holder;
+        if constexpr (profiled) {
+            cohort.present.fetch_sub(1, std::memory_order_relaxed);
+        }
+        if (cohort.local.has_waiters() && ++cohort.passes < pass_limit) {
+            cohort.local.unlock();// the next local owner inherits the global lock
+            return;
+        }
+        cohort.passes = 0;
+        cohort.owns_global = false;
+        if constexpr (profiled) {
+            global_owner.store(nullptr, std::memory_order_relaxed);
+        }
+        global.unlock();
+        cohort.local.unlock();
+    }
+};
 
-            std::vector<std::thread> workers(thread_cnt);
 
-            for (int i = 0; i < thread_cnt; ++i) {
-                workers[i] = std::thread(task, i);
+// Flat combining (Hendler, Incze, Shavit, Tzafrir): instead of taking a lock, a thread publishes its
+// critical section in a slot and waits on its own request. Whoever wins the combiner flag runs every
+// published request in a row, so the protected data stays in the combiner's cache.
+// Profiled, a request's wait lasts until the combiner starts it and its hold is the time it runs
+template<typename Backoff = ExponentialBackoff>
+class FlatCombiner : public LockProfile {
+private:
+    struct Request {
+        void (* call)(const void*);
+        const void* job;// Job may be const, run casts back to its exact type
+        std::exception_ptr error;
+        std::atomic<bool> done{false};
+        uint64_t started = 0;// set by the combiner when profiled
+    };
+
+    struct alignas(64) Slot {
+        std::atomic<Request*> request{nullptr};
+    };
+
+    static constexpr int combine_passes = 3;// a pass that finds nothing ends combining early
+
+    const size_t slot_cnt;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> used;// slots at or past this index have never been published to
+    alignas(64) std::atomic<bool> combining;
+
+    // threads start at a slot of their own and move on if it is taken
+    size_t publish(Request& request) {
+        Backoff backoff;
+        for (size_t index = thread_slot() % slot_cnt;; index = (index + 1) % slot_cnt) {
+            Request* expected = nullptr;
+            if (slots[index].request.compare_exchange_strong(expected, &request, std::memory_order_release,
+                                                             std::memory_order_relaxed)) {
+                size_t bound = used.load(std::memory_order_relaxed);
+                while (bound <= index &&
+                       !used.compare_exchange_weak(bound, index + 1, std::memory_order_relaxed)) {
+                }
+                return index;
+            }
+            if ((index + 1) % slot_cnt == thread_slot() % slot_cnt) {
+                backoff();// every slot busy
             }
+        }
+    }
 
-            for (auto& worker : workers) {
-                if (worker.joinable()) {
-                    worker.join();
+    void combine() {
+        for (int pass = 0; pass < combine_passes; ++pass) {
+            bool found = false;
+            const size_t bound = used.load(std::memory_order_acquire);
+            for (size_t index = 0; index < bound; ++index) {
+                Request* request = slots[index].request.load(std::memory_order_acquire);
+                if (!request) {
+                    continue;
+                }
+                found = true;
+                request->started = entered();
+                try {
+                    request->call(request->job);
+                } catch (...) {
+                    request->error = std::current_exception();
                 }
+                released();
+                // the slot is free before its owner may leave and take the request with it
+                slots[index].request.store(nullptr, std::memory_order_relaxed);
+                request->done.store(true, std::memory_order_release);
             }
+            if (!found) {
+                return;
+            }
+        }
+    }
 
-            std::cout << thread_cnt << " threads\n";
+public:
+    explicit FlatCombiner(const size_t slot_cnt = 128) :
+            slot_cnt(std::max<size_t>(1, slot_cnt)),
+            slots(new Slot[this->slot_cnt]),
+            used(0),
+            combining(false) {}
+
+    // runs fn() mutually exclusive with every other execute, on this thread or on the combiner
+    template<typename Fn>
+    auto execute(Fn&& fn) {
+        using Result = std::invoke_result_t<Fn&>;
+        if constexpr (std::is_void_v<Result>) {
+            run(fn);
+        } else {
+            std::optional<Result> result;
+            auto job = [&] { result.emplace(fn()); };
+            run(job);
+            return std::move(*result);
+        }
+    }
 
-            std::cout << "time elapsed" << std::endl;
-            delete t;
+private:
+    template<typename Job>
+    void run(Job& job) {
+        Probe probe = begin_acquire();
+        Request request{[](const void* job) { (*static_cast<Job*>(const_cast<void*>(job)))(); }, &job, nullptr};
+        publish(request);
 
-            double avg;
-            int cnt = 0;
-            for (auto& arr: vec) {
-                for (auto& item: arr) {
-                    ++cnt;
-                    avg += duration_cast<milliseconds>(item.second - item.first).count();
-                }
+        Backoff backoff;
+        while (!request.done.load(std::memory_order_acquire)) {
+            if (!combining.load(std::memory_order_relaxed) &&
+                !combining.exchange(true, std::memory_order_acquire)) {
+                combine();
+                combining.store(false, std::memory_order_release);
+            } else {
+                probe.spin();
+                backoff();
             }
+        }
+        waited_until(probe, request.started);
+        if (request.error) {
+            std::rethrow_exception(request.error);
+        }
+    }
+};
 
-//            std::cout << avg << "   " << cnt << std::endl;
-            std::cout << "avg = " << avg / static_cast<double>(cnt) << std::endl << std::endl;
+// Locks that take the critical section as a closure instead of being held around it
+template<typename Lock>
+struct delegates : std::false_type {
+};
+
+template<typename Backoff>
+struct delegates<FlatCombiner<Backoff>> : std::true_type {
+};
+
+// fn() under lock whichever way the lock works, so Tester can drive FlatCombiner too
+template<typename Lock, typename Fn>
+auto run_locked(Lock& lock, Fn&& fn) {
+    if constexpr (delegates<Lock>::value) {
+        return lock.execute(fn);
+    } else {
+        std::lock_guard<Lock> guard(lock);
+        return fn();
+    }
+}
 
+
+// consecutive benchmark threads go to neighbouring allowed CPUs, so they share a node
+inline void pin_thread(std::thread& thread, const int index) {
+#ifdef __linux__
+    static const std::vector<int> cpus = NumaTopology::get().cpu_order();
+    if (cpus.empty()) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[index % cpus.size()], &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+}
+
+struct TestConfig {
+    int threads = 4;
+    long long acquisitions = 200'000;// in total, threads compete for them
+    int read_percent = 0;// share of acquisitions that only read, shared where the lock has a shared mode
+    int cs_work = 0;// shared counters incremented (or read) inside the critical section
+    int ncs_work = 0;// pauses between leaving the critical section and knocking again
+    bool pin = true;
+};
+
+struct TestResult {
+    std::string lock;
+    TestConfig config;
+    double seconds = 0;
+    long long reads = 0;
+    double wait_ns[5] = {};// p50, p90, p99, p99.9, max from knocking to entering
+    double jain_index = 0;// of per-thread acquisition counts, 1 is perfectly fair
+    long long max_consecutive = 0;// longest run of writes by one thread
+
+    double throughput() const {
+        return static_cast<double>(config.acquisitions) / seconds;
+    }
+
+    static void write_csv_header(std::ostream& out) {
+        out << "lock,threads,acquisitions,read_percent,reads,cs_work,ncs_work,pinned,seconds,acquisitions_per_s,"
+               "wait_p50_ns,wait_p90_ns,wait_p99_ns,wait_p999_ns,wait_max_ns,jain_index,max_consecutive\n";
+    }
+
+    void write_csv(std::ostream& out) const {
+        out << lock << ',' << config.threads << ',' << config.acquisitions << ',' << config.read_percent << ','
+            << reads << ',' << config.cs_work << ',' << config.ncs_work << ',' << config.pin << ',' << seconds
+            << ',' << throughput();
+        for (double wait : wait_ns) {
+            out << ',' << wait;
         }
+        out << ',' << jain_index << ',' << max_consecutive << '\n';
+    }
 
+    void write_json(std::ostream& out) const {
+        out << "{\"lock\":\"" << lock << "\",\"threads\":" << config.threads << ",\"acquisitions\":"
+            << config.acquisitions << ",\"read_percent\":" << config.read_percent << ",\"reads\":" << reads
+            << ",\"cs_work\":" << config.cs_work << ",\"ncs_work\":" << config.ncs_work
+            << ",\"pinned\":" << (config.pin ? "true" : "false") << ",\"seconds\":" << seconds
+            << ",\"acquisitions_per_s\":" << throughput() << ",\"wait_ns\":{\"p50\":" << wait_ns[0]
+            << ",\"p90\":" << wait_ns[1] << ",\"p99\":" << wait_ns[2] << ",\"p999\":" << wait_ns[3]
+            << ",\"max\":" << wait_ns[4] << "},\"jain_index\":" << jain_index << ",\"max_consecutive\":"
+            << max_consecutive << "}";
     }
+};
 
+// Locks with lock_shared()/unlock_shared(), which readers take through std::shared_lock
+template<typename Lock, typename = void>
+struct has_shared_mode : std::false_type {
 };
 
-int main() {
-    Tester<TTAS> tester;
-    tester.test1();
-//    std::cout << "next test\n";
-//    tester.test3();
+template<typename Lock>
+struct has_shared_mode<Lock, std::void_t<decltype(std::declval<Lock&>().lock_shared())>> : std::true_type {
+};
 
-}
+// Threads compete for a fixed number of acquisitions of one lock, claimed from a shared budget a few
+// at a time. Everything recorded is preallocated: every thread keeps its waits in its own buffer, large
+// enough for all acquisitions, and a write only adds the writer's number to the shared order log.
+// run() throws if the lock ever let a writer in next to anyone else
+template<typename Lock=TTAS<>>
+class Tester {
+private:
+    static constexpr long long budget_chunk = 16;
 
+    struct alignas(64) ThreadLog {
+        std::vector<uint32_t> waits;// ticks, saturated
+        long long acquisitions = 0;
+        long long reads = 0;
+    };
 
-//1 threads
-//        time elapsed
-//356 ms
-//        avg = 6.93381e-316
-//
-//2 threads
-//        time elapsed
-//606 ms
-//        avg = 5.69999e-05
-//
-//3 threads
-//        time elapsed
-//679 ms
-//        avg = 0.000222999
-//
-//4 threads
-//        time elapsed
-//652 ms
-//        avg = 0.000379998
-//
-//5 threads
-//        time elapsed
-//573 ms
-//        avg = 0.000608997
-//
-//6 threads
-//        time elapsed
-//363 ms
-//        avg = 0.000773995
-//
-//7 threads
-//        time elapsed
-//806 ms
-//        avg = 0.00344698
-//
-//8 threads
-//        time elapsed
-//10184 ms
-//        avg = 0.0728824
\ No newline at end of file
+public:
+    explicit Tester(std::string name = "lock") : name(std::move(name)) {}
+
+    TestResult run(const TestConfig& config) {
+        const int thread_cnt = std::max(1, config.threads);
+        const long long limit = config.acquisitions;
+        const uint32_t read_percent = static_cast<uint32_t>(std::clamp(config.read_percent, 0, 100));
+
+        Lock lock{};
+        long long writes = 0;// only ever changed by a writer
+        std::vector<int> order(limit);
+        std::vector<uint64_t> shared_data(std::max(1, config.cs_work));
+        std::atomic<bool> writing(false);// relaxed, a cheap tripwire rather than a second lock
+        std::atomic<bool> violated(false);
+        std::vector<ThreadLog> logs(thread_cnt);
+        for (auto& log : logs) {
+            log.waits.reserve(limit);
+        }
+        alignas(64) std::atomic<long long> budget(limit);
+        std::atomic<int> ready(0);
+        std::atomic<bool> start(false);
+
+        auto write = [&](const int num) {
+            if (writing.exchange(true, std::memory_order_relaxed)) {
+                violated.store(true, std::memory_order_relaxed);
+            }
+            order[writes++] = num;
+            for (int w = 0; w < config.cs_work; ++w) {
+                ++shared_data[w];
+            }
+            writing.store(false, std::memory_order_relaxed);
+        };
+
+        // counters a writer leaves unequal, or a writer inside, mean the read overlapped a write
+        auto read = [&] {
+            if (writing.load(std::memory_order_relaxed)) {
+                violated.store(true, std::memory_order_relaxed);
+            }
+            for (int w = 1; w < config.cs_work; ++w) {
+                if (shared_data[w] != shared_data[0]) {
+                    violated.store(true, std::memory_order_relaxed);
+                }
+            }
+        };
+
+        auto task = [&](const int num) {
+            ThreadLog& log = logs[num];
+            long long quota = 0;
+            ready.fetch_add(1);
+            while (!start.load(std::memory_order_acquire)) {
+                cpu_relax();
+            }
+            while (true) {
+                if (quota == 0) {
+                    long long left = budget.fetch_sub(budget_chunk, std::memory_order_relaxed);
+                    if (left <= 0) {
+                        break;
+                    }
+                    quota = std::min(budget_chunk, left);
+                }
+                --quota;
+
+                const bool reading = backoff_random() % 100 < read_percent;
+                uint64_t enter = 0;
+                const uint64_t knock = profile_ticks();
+                if constexpr (has_shared_mode<Lock>::value) {
+                    if (reading) {
+                        std::shared_lock<Lock> guard(lock);
+                        enter = profile_ticks();
+                        read();
+                    } else {
+                        std::lock_guard<Lock> guard(lock);
+                        enter = profile_ticks();
+                        write(num);
+                    }
+                } else {
+                    run_locked(lock, [&] {
+                        enter = profile_ticks();
+                        reading ? read() : write(num);
+                    });
+                }
+                log.waits.push_back(static_cast<uint32_t>(std::min<uint64_t>(enter - knock, UINT32_MAX)));
+                ++log.acquisitions;
+                log.reads += reading;
+                for (int w = 0; w < config.ncs_work; ++w) {
+                    cpu_relax();
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int i = 0; i < thread_cnt; ++i) {
+            workers.emplace_back(task, i);
+            if (config.pin) {
+                pin_thread(workers.back(), i);
+            }
+        }
+        while (ready.load() != thread_cnt) {
+            std::this_thread::yield();
+        }
+        auto begin = std::chrono::steady_clock::now();
+        start.store(true, std::memory_order_release);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+        TestResult result;
+        result.lock = name;
+        result.config = config;
+        result.config.threads = thread_cnt;
+        result.seconds = elapsed.count();
+
+        // exact totals: a lost increment means two writers were inside at once
+        long long total = 0;
+        for (auto& log : logs) {
+            total += log.acquisitions;
+            result.reads += log.reads;
+        }
+        bool counters_match = std::all_of(shared_data.begin(), shared_data.begin() + config.cs_work,
+                                          [&](const uint64_t value) { return value == static_cast<uint64_t>(writes); });
+        if (violated.load() || total != limit || writes != limit - result.reads || !counters_match) {
+            throw std::runtime_error(name + ": mutual exclusion violated, " + std::to_string(total) + " of " +
+                                     std::to_string(limit) + " acquisitions, " + std::to_string(writes) +
+                                     " writes recorded of " + std::to_string(limit - result.reads));
+        }
+
+        std::vector<uint32_t> waits;
+        waits.reserve(limit);
+        double sum = 0;
+        double sum_squares = 0;
+        for (auto& log : logs) {
+            waits.insert(waits.end(), log.waits.begin(), log.waits.end());
+            sum += static_cast<double>(log.acquisitions);
+            sum_squares += static_cast<double>(log.acquisitions) * static_cast<double>(log.acquisitions);
+        }
+        result.jain_index = sum_squares > 0 ? sum * sum / (thread_cnt * sum_squares) : 1;
+
+        std::sort(waits.begin(), waits.end());
+        const double quantiles[5] = {0.5, 0.9, 0.99, 0.999, 1.0};
+        for (int q = 0; q < 5 && !waits.empty(); ++q) {
+            size_t index = std::min(waits.size() - 1, static_cast<size_t>(quantiles[q] * waits.size()));
+            result.wait_ns[q] = waits[index] * ns_per_tick();
+        }
+
+        for (long long i = 0, run = 0; i < writes; ++i) {
+            run = (i > 0 && order[i] == order[i - 1]) ? run + 1 : 1;
+            result.max_consecutive = std::max(result.max_consecutive, run);
+        }
+        return result;
+    }
+
+private:
+    std::string name;
+};
+
+// Runs every lock type over the thread counts and read shares and prints one line per run. Locks without
+// a shared mode take reads exclusively. Exits with 1 if any lock broke mutual exclusion.
+//   lock [--threads 1,2,4,8] [--reads 0,90] [--acquisitions N] [--cs N] [--ncs N] [--no-pin]
+//        [--csv path] [--json path]
+int main(int argc, char* argv[]) {
+    TestConfig config;
+    std::vector<int> thread_cnts;
+    const int cpu_cnt = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    for (int threads = 1; threads < cpu_cnt; threads *= 2) {
+        thread_cnts.push_back(threads);
+    }
+    thread_cnts.push_back(cpu_cnt);
+    thread_cnts.push_back(2 * cpu_cnt);// oversubscribed
+    std::vector<int> read_percents = {0, 90};
+    std::string csv_path;
+    std::string json_path;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string option = argv[i];
+            if (option == "--no-pin") {
+                config.pin = false;
+                continue;
+            }
+            if (i + 1 == argc) {
+                std::cerr << option << " needs a value" << std::endl;
+                return 1;
+            }
+            std::string value = argv[++i];
+            if (option == "--threads") {
+                thread_cnts = parse_int_list(value, 1, INT_MAX);
+            } else if (option == "--reads") {
+                read_percents = parse_int_list(value, 0, 100);
+            } else if (option == "--acquisitions") {
+                config.acquisitions = std::max(1LL, std::atoll(value.c_str()));
+            } else if (option == "--cs") {
+                config.cs_work = std::max(0, std::atoi(value.c_str()));
+            } else if (option == "--ncs") {
+                config.ncs_work = std::max(0, std::atoi(value.c_str()));
+            } else if (option == "--csv") {
+                csv_path = value;
+            } else if (option == "--json") {
+                json_path = value;
+            } else {
+                std::cerr << "unknown option " << option << std::endl;
+                return 1;
+            }
+        }
+    } catch (const std::invalid_argument& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+
+    std::ofstream csv;
+    if (!csv_path.empty()) {
+        csv.open(csv_path);
+        TestResult::write_csv_header(csv);
+    }
+    std::ofstream json;
+    if (!json_path.empty()) {
+        json.open(json_path);
+        json << "[";
+    }
+    if ((!csv_path.empty() && !csv) || (!json_path.empty() && !json)) {
+        std::cerr << "cannot open output file" << std::endl;
+        return 1;
+    }
+
+    bool first = true;
+    auto report = [&](const TestResult& result) {
+        std::cout << result.lock << ", " << result.config.threads << " threads, " << result.config.read_percent
+                  << "% reads: " << result.throughput() << " acquisitions/s, wait p50 " << result.wait_ns[0]
+                  << " ns, p99 " << result.wait_ns[2] << " ns, max " << result.wait_ns[4] << " ns, jain "
+                  << result.jain_index << ", max consecutive " << result.max_consecutive << std::endl;
+        if (csv) {
+            result.write_csv(csv);
+        }
+        if (json) {
+            json << (first ? "\n" : ",\n");
+            result.write_json(json);
+        }
+        first = false;
+    };
+    bool broken = false;
+    auto suite = [&](auto tester) {
+        for (int read_percent : read_percents) {
+            for (int threads : thread_cnts) {
+                TestConfig run_config = config;
+                run_config.threads = threads;
+                run_config.read_percent = read_percent;
+                try {
+                    report(tester.run(run_config));
+                } catch (const std::runtime_error& error) {
+                    std::cerr << error.what() << std::endl;
+                    broken = true;
+                }
+            }
+        }
+    };
+
+    suite(Tester<TAS<>>("tas"));
+    suite(Tester<TTAS<>>("ttas"));
+    suite(Tester<TicketLock<>>("ticket"));
+    suite(Tester<FutexLock>("futex"));
+    suite(Tester<MCSLock<>>("mcs"));
+    suite(Tester<CLHLock<>>("clh"));
+    suite(Tester<PhaseFairRWLock<>>("phase_fair_rw"));
+    suite(Tester<BigReaderLock<>>("big_reader"));
+    suite(Tester<CohortLock<>>("cohort"));
+    suite(Tester<FlatCombiner<>>("flat_combining"));
+
+    if (json) {
+        json << "\n]\n";
+    }
+    return broken ? 1 : 0;
+}
@@ -1,293 +1,2723 @@
 #include <iostream>
+#include <limits>
 #include <vector>
 #include <thread>
 #include <fstream>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <charconv>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MATRIX_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "cpu_list.h"
+
+#ifndef MATRIX_BLOCK_SIZE
+#define MATRIX_BLOCK_SIZE 8
+#endif
+
+constexpr int block_size = MATRIX_BLOCK_SIZE;
+
+static_assert(block_size % 8 == 0, "SIMD kernels work on rows of 8 elements");
+
+template<typename T>
+using Tile = T[block_size][block_size];
+
+// dst += first * second, i-k-j order so the inner loop streams rows of second and dst.
+// Integers wrap like the SIMD kernels do, in the unsigned type, so Strassen's sums of overflowed terms stay exact
+template<typename T, typename Acc>
+inline void multiply_add_scalar(Tile<Acc>& dst, const Tile<T>& first, const Tile<T>& second) {
+    using Wrap = typename std::conditional_t<std::is_integral_v<Acc>, std::make_unsigned<Acc>,
+                                             std::common_type<Acc>>::type;
+    for (int i = 0; i < block_size; ++i) {
+        for (int k = 0; k < block_size; ++k) {
+            Wrap r = static_cast<Wrap>(static_cast<Acc>(first[i][k]));
+            for (int j = 0; j < block_size; ++j) {
+                dst[i][j] = static_cast<Acc>(static_cast<Wrap>(dst[i][j]) +
+                                             r * static_cast<Wrap>(static_cast<Acc>(second[k][j])));
+            }
+        }
+    }
+}
+
+#ifdef MATRIX_X86_KERNELS
+
+// The vector kernels keep the whole dst tile in registers and load every row of second once
+
+__attribute__((target("sse4.1")))
+inline void multiply_add_sse41(Tile<int>& dst, const Tile<int>& first, const Tile<int>& second) {
+    constexpr int lanes = 4;
+    __m128i acc[block_size][block_size / lanes];
+    for (int i = 0; i < block_size; ++i) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            acc[i][c] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&dst[i][c * lanes]));
+        }
+    }
+    for (int k = 0; k < block_size; ++k) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            __m128i row = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&second[k][c * lanes]));
+            for (int i = 0; i < block_size; ++i) {
+                acc[i][c] = _mm_add_epi32(acc[i][c], _mm_mullo_epi32(_mm_set1_epi32(first[i][k]), row));
+            }
+        }
+    }
+    for (int i = 0; i < block_size; ++i) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&dst[i][c * lanes]), acc[i][c]);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+inline void multiply_add_avx2(Tile<int>& dst, const Tile<int>& first, const Tile<int>& second) {
+    constexpr int lanes = 8;
+    __m256i acc[block_size][block_size / lanes];
+    for (int i = 0; i < block_size; ++i) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            acc[i][c] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&dst[i][c * lanes]));
+        }
+    }
+    for (int k = 0; k < block_size; ++k) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            __m256i row = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&second[k][c * lanes]));
+            for (int i = 0; i < block_size; ++i) {
+                acc[i][c] = _mm256_add_epi32(acc[i][c], _mm256_mullo_epi32(_mm256_set1_epi32(first[i][k]), row));
+            }
+        }
+    }
+    for (int i = 0; i < block_size; ++i) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[i][c * lanes]), acc[i][c]);
+        }
+    }
+}
+
+// a zmm register holds the same 8 columns of two adjacent rows: low half row i, high half row i + 1.
+// Halves are moved with masked broadcasts and extracts only: in GCC 12's headers the unmasked
+// insert, broadcast, extract and even zext/cast pass an undefined vector and warn about it
+__attribute__((target("avx512f")))
+inline void multiply_add_avx512(Tile<int>& dst, const Tile<int>& first, const Tile<int>& second) {
+    constexpr int lanes = 8;
+    __m512i acc[block_size / 2][block_size / lanes];
+    for (int i = 0; i < block_size; i += 2) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&dst[i][c * lanes]));
+            __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&dst[i + 1][c * lanes]));
+            acc[i / 2][c] = _mm512_mask_broadcast_i64x4(_mm512_maskz_broadcast_i64x4(0x0F, lo), 0xF0, hi);
+        }
+    }
+    for (int k = 0; k < block_size; ++k) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            __m512i row = _mm512_maskz_broadcast_i64x4(0xFF,
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&second[k][c * lanes])));
+            for (int i = 0; i < block_size; i += 2) {
+                __m512i r = _mm512_mask_set1_epi32(_mm512_set1_epi32(first[i][k]), 0xFF00, first[i + 1][k]);
+                acc[i / 2][c] = _mm512_add_epi32(acc[i / 2][c], _mm512_mullo_epi32(r, row));
+            }
+        }
+    }
+    for (int i = 0; i < block_size; i += 2) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[i][c * lanes]),
+                                _mm512_maskz_extracti64x4_epi64(0xF, acc[i / 2][c], 0));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[i + 1][c * lanes]),
+                                _mm512_maskz_extracti64x4_epi64(0xF, acc[i / 2][c], 1));
+        }
+    }
+}
+
+// int64 has no vector multiply below AVX-512DQ's vpmullq; whole rows of 8 columns per zmm register
+__attribute__((target("avx512f,avx512dq")))
+inline void multiply_add_int64_avx512(Tile<int64_t>& dst, const Tile<int64_t>& first, const Tile<int64_t>& second) {
+    constexpr int lanes = 8;
+    __m512i acc[block_size][block_size / lanes];
+    for (int i = 0; i < block_size; ++i) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            acc[i][c] = _mm512_loadu_si512(&dst[i][c * lanes]);
+        }
+    }
+    for (int k = 0; k < block_size; ++k) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            __m512i row = _mm512_loadu_si512(&second[k][c * lanes]);
+            for (int i = 0; i < block_size; ++i) {
+                acc[i][c] = _mm512_add_epi64(acc[i][c], _mm512_mullo_epi64(_mm512_set1_epi64(first[i][k]), row));
+            }
+        }
+    }
+    for (int i = 0; i < block_size; ++i) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            _mm512_storeu_si512(&dst[i][c * lanes], acc[i][c]);
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void multiply_add_fma(Tile<float>& dst, const Tile<float>& first, const Tile<float>& second) {
+    constexpr int lanes = 8;
+    __m256 acc[block_size][block_size / lanes];
+    for (int i = 0; i < block_size; ++i) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            acc[i][c] = _mm256_loadu_ps(&dst[i][c * lanes]);
+        }
+    }
+    for (int k = 0; k < block_size; ++k) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            __m256 row = _mm256_loadu_ps(&second[k][c * lanes]);
+            for (int i = 0; i < block_size; ++i) {
+                acc[i][c] = _mm256_fmadd_ps(_mm256_set1_ps(first[i][k]), row, acc[i][c]);
+            }
+        }
+    }
+    for (int i = 0; i < block_size; ++i) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            _mm256_storeu_ps(&dst[i][c * lanes], acc[i][c]);
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void multiply_add_fma(Tile<double>& dst, const Tile<double>& first, const Tile<double>& second) {
+    constexpr int lanes = 4;
+    __m256d acc[block_size][block_size / lanes];
+    for (int i = 0; i < block_size; ++i) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            acc[i][c] = _mm256_loadu_pd(&dst[i][c * lanes]);
+        }
+    }
+    for (int k = 0; k < block_size; ++k) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            __m256d row = _mm256_loadu_pd(&second[k][c * lanes]);
+            for (int i = 0; i < block_size; ++i) {
+                acc[i][c] = _mm256_fmadd_pd(_mm256_set1_pd(first[i][k]), row, acc[i][c]);
+            }
+        }
+    }
+    for (int i = 0; i < block_size; ++i) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            _mm256_storeu_pd(&dst[i][c * lanes], acc[i][c]);
+        }
+    }
+}
+
+// int8 x int8 -> int32: two steps of k at once through vpmaddwd, every 32-bit lane gets
+// first[i][k] * second[k][j] + first[i][k + 1] * second[k + 1][j]
+__attribute__((target("avx2")))
+inline void multiply_add_int8_avx2(Tile<int32_t>& dst, const Tile<int8_t>& first, const Tile<int8_t>& second) {
+    constexpr int lanes = 8;
+    __m256i acc[block_size][block_size / lanes];
+    for (int i = 0; i < block_size; ++i) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            acc[i][c] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&dst[i][c * lanes]));
+        }
+    }
+    for (int k = 0; k < block_size; k += 2) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            __m128i lo = _mm_cvtepi8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&second[k][c * lanes])));
+            __m128i hi = _mm_cvtepi8_epi16(
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&second[k + 1][c * lanes])));
+            __m256i rows = _mm256_set_m128i(_mm_unpackhi_epi16(lo, hi), _mm_unpacklo_epi16(lo, hi));
+            for (int i = 0; i < block_size; ++i) {
+                uint32_t pair = static_cast<uint16_t>(first[i][k]) |
+                                static_cast<uint32_t>(static_cast<uint16_t>(first[i][k + 1])) << 16;
+                acc[i][c] = _mm256_add_epi32(acc[i][c],
+                                             _mm256_madd_epi16(_mm256_set1_epi32(static_cast<int>(pair)), rows));
+            }
+        }
+    }
+    for (int i = 0; i < block_size; ++i) {
+        for (int c = 0; c < block_size / lanes; ++c) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[i][c * lanes]), acc[i][c]);
+        }
+    }
+}
+
+#endif
+
+// dst += first * second on one tile, T elements accumulated in Acc. The generic version is
+// the scalar loop; specialisations pick a hand-written variant once at startup by CPUID
+template<typename T, typename Acc>
+struct TileKernel {
+    static void multiply_add(Tile<Acc>& dst, const Tile<T>& first, const Tile<T>& second) {
+        multiply_add_scalar<T, Acc>(dst, first, second);
+    }
+};
+
+template<>
+struct TileKernel<int, int> {
+    using Kernel = void (*)(Tile<int>&, const Tile<int>&, const Tile<int>&);
+
+    static Kernel select() {
+#ifdef MATRIX_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return multiply_add_avx512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return multiply_add_avx2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return multiply_add_sse41;
+        }
+#endif
+        return multiply_add_scalar<int, int>;
+    }
+
+    static inline const Kernel multiply_add = select();
+};
+
+template<>
+struct TileKernel<float, float> {
+    using Kernel = void (*)(Tile<float>&, const Tile<float>&, const Tile<float>&);
+
+    static Kernel select() {
+#ifdef MATRIX_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return multiply_add_fma;
+        }
+#endif
+        return multiply_add_scalar<float, float>;
+    }
+
+    static inline const Kernel multiply_add = select();
+};
+
+template<>
+struct TileKernel<double, double> {
+    using Kernel = void (*)(Tile<double>&, const Tile<double>&, const Tile<double>&);
+
+    static Kernel select() {
+#ifdef MATRIX_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return multiply_add_fma;
+        }
+#endif
+        return multiply_add_scalar<double, double>;
+    }
+
+    static inline const Kernel multiply_add = select();
+};
+
+template<>
+struct TileKernel<int8_t, int32_t> {
+    using Kernel = void (*)(Tile<int32_t>&, const Tile<int8_t>&, const Tile<int8_t>&);
+
+    static Kernel select() {
+#ifdef MATRIX_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return multiply_add_int8_avx2;
+        }
+#endif
+        return multiply_add_scalar<int8_t, int32_t>;
+    }
+
+    static inline const Kernel multiply_add = select();
+};
+
+template<>
+struct TileKernel<int64_t, int64_t> {
+    using Kernel = void (*)(Tile<int64_t>&, const Tile<int64_t>&, const Tile<int64_t>&);
+
+    static Kernel select() {
+#ifdef MATRIX_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+            return multiply_add_int64_avx512;
+        }
+#endif
+        return multiply_add_scalar<int64_t, int64_t>;
+    }
+
+    static inline const Kernel multiply_add = select();
+};
+
+// Where the pages of a tile grid end up on a NUMA machine
+enum class Placement {
+    local,// wherever the allocating thread runs
+    first_touch,// tile rows zeroed by the pool, each on the node of the worker that owns those rows in gemm
+    interleaved// pages spread round-robin over all nodes, for operands every worker reads
+};
+
+// Zero pages nobody has touched yet, so each one is placed when it is first written
+inline char* map_pages(const size_t bytes) {
+    void* pages = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "cannot map " + std::to_string(bytes) + " bytes");
+    }
+    return static_cast<char*>(pages);
+}
+
+// Only a hint: on one node, or where mbind is refused, pages stay first-touch
+inline void interleave_pages(char* pages, const size_t bytes) {
+#ifdef __linux__
+    const auto& nodes = NumaTopology::get().nodes;
+    if (nodes.size() < 2) {
+        return;
+    }
+    constexpr int mask_bits = 1024;
+    constexpr int word_bits = 8 * sizeof(unsigned long);
+    unsigned long mask[mask_bits / word_bits] = {};
+    for (auto& node : nodes) {
+        if (node.id < mask_bits) {
+            mask[node.id / word_bits] |= 1UL << (node.id % word_bits);
+        }
+    }
+    syscall(SYS_mbind, pages, bytes, MPOL_INTERLEAVE, mask, mask_bits, 0);
+#endif
+}
+
+// Cache blocking of the tile loops, counted in tiles (Goto/BLIS style):
+// kc tiles of an A row and of a B column fit in L1 together,
+// an mc x kc panel of A fits in L2, a kc x nc panel of B fits in L3
+struct GemmConfig {
+    int mc = 64;
+    int kc = 32;
+    int nc = 512;
+    int strassen_crossover = 32;// Strassen recursion hands blocks of at most this many tiles a side to the tile kernel
+    Placement result_placement = Placement::first_touch;
+    Placement packed_placement = Placement::interleaved;// the packed B panel is read by every worker
+
+    // tile_bytes is the size of one operand tile
+    static GemmConfig tuned(const long tile_bytes = sizeof(Tile<int>)) {
+
+        auto cache_size = [](const int name, const long fallback) {
+            long size = sysconf(name);
+            return size > 0 ? size : fallback;
+        };
+
+        long l1 = cache_size(_SC_LEVEL1_DCACHE_SIZE, 32 * 1024);
+        long l2 = cache_size(_SC_LEVEL2_CACHE_SIZE, 256 * 1024);
+        long l3 = cache_size(_SC_LEVEL3_CACHE_SIZE, 8 * 1024 * 1024);
+
+        // use half of every level, the rest is left for C tiles and whatever else lives there
+        GemmConfig config;
+        config.kc = static_cast<int>(std::max(1L, l1 / 2 / (2 * tile_bytes)));
+        config.mc = static_cast<int>(std::max(1L, l2 / 2 / (config.kc * tile_bytes)));
+        config.nc = static_cast<int>(std::max(1L, l3 / 2 / (config.kc * tile_bytes)));
+        return config;
+    }
+};
+
+// Persistent workers shared by every multiply. A parallel job is cut into ranges of indices,
+// each participant gets its prepare_job() share in its own deque and idle ones steal from the others.
+// Pinned workers sit on CPUs in node order, so neighbouring shares, and the tile rows
+// first-touched with them, stay on one node
+class ThreadPool {
+public:
+    explicit ThreadPool(const size_t thread_cnt = std::max(1u, std::thread::hardware_concurrency()),
+                        const bool pin_workers = false) :
+            thread_cnt_(std::max<size_t>(1, thread_cnt)),
+            pin_workers_(pin_workers),
+            queues_(new Queue[thread_cnt_]) {
+        // the thread calling run_parallel takes part as the last participant
+        for (size_t i = 0; i + 1 < thread_cnt_; ++i) {
+            workers_.emplace_back(&ThreadPool::work, this, i);
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mut_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& worker : workers_) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+    size_t get_thread_cnt() const noexcept { return thread_cnt_; }
+
+    // seconds each participant spent draining jobs since the last reset, the caller's share is last
+    std::vector<double> busy_seconds() const {
+        std::vector<double> seconds(thread_cnt_);
+        for (size_t i = 0; i < thread_cnt_; ++i) {
+            seconds[i] = static_cast<double>(queues_[i].busy_ns.load(std::memory_order_relaxed)) * 1e-9;
+        }
+        return seconds;
+    }
+
+    void reset_busy() noexcept {
+        for (size_t i = 0; i < thread_cnt_; ++i) {
+            queues_[i].busy_ns.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    static ThreadPool& instance() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    // splits [0, total) into parts contiguous inclusive ranges
+    static std::vector<std::pair<int, int>> prepare_job(const int total, const size_t parts) {
+        const int part_cnt = static_cast<int>(parts);
+        int cells_per_thread = total / part_cnt;
+        std::vector<int> distribution(parts, cells_per_thread);
+
+
+        for (int i = 0, rest = total % part_cnt; rest > 0; ++i, --rest) {
+            ++distribution[i];
+        }
+
+        std::vector<std::pair<int, int>> threads_work(parts);
+        for (int i = 0, current = 0; i < part_cnt; ++i) {
+            threads_work[i].first = current;
+            current = current + distribution[i] - 1;
+            threads_work[i].second = current;
+            ++current;
+        }
+        return threads_work;
+    }
+
+    // calls job(first, last) on inclusive ranges of at most grain indices covering [0, total)
+    template<typename Job>
+    void run_parallel(const int total, const Job& job, int grain = 0) {
+        if (total <= 0) {
+            return;
+        }
+        if (thread_cnt_ == 1 || active_pool_ == this) {// nested calls run inline
+            job(0, total - 1);
+            return;
+        }
+        if (grain <= 0) {
+            grain = std::max<int>(1, total / static_cast<int>(thread_cnt_ * 4));
+        }
+
+        Task task{[](const void* job, const int first, const int last) {
+            (*static_cast<const Job*>(job))(first, last);
+        }, &job};
+
+        std::lock_guard<std::mutex> submit_lock(submit_mut_);
+        auto threads_work = prepare_job(total, thread_cnt_);
+
+        // the count goes out before any range: a worker still draining the previous job
+        // can pick up a new range as soon as it is pushed
+        int ranges_cnt = 0;
+        for (auto& [first, last] : threads_work) {
+            ranges_cnt += (last - first + grain) / grain;
+        }
+        remaining_.store(ranges_cnt, std::memory_order_relaxed);
+
+        for (size_t i = 0; i < thread_cnt_; ++i) {
+            std::lock_guard<std::mutex> lock(queues_[i].mut);
+            for (int first = threads_work[i].first; first <= threads_work[i].second; first += grain) {
+                queues_[i].ranges.push_back({first, std::min(first + grain - 1, threads_work[i].second), &task});
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mut_);
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        // restored, not cleared: the caller may itself be a participant of another pool
+        const ThreadPool* previous = active_pool_;
+        active_pool_ = this;
+        timed_drain(thread_cnt_ - 1);
+        active_pool_ = previous;
+
+        // every range is accounted for even when one threw, job and task outlive all participants
+        while (remaining_.load(std::memory_order_acquire) != 0) {
+            std::this_thread::yield();
+        }
+
+        if (failed_.load(std::memory_order_relaxed)) {
+            std::exception_ptr failure = std::move(failure_);
+            failure_ = nullptr;
+            failed_.store(false, std::memory_order_relaxed);
+            std::rethrow_exception(failure);
+        }
+    }
+
+private:
+    struct Task {
+        void (* call)(const void*, int, int);
+        const void* job;
+    };
+
+    struct Range {
+        int first;
+        int last;
+        const Task* task;
+    };
+
+    struct alignas(64) Queue {
+        std::mutex mut;
+        std::deque<Range> ranges;
+        std::atomic<long long> busy_ns{0};// time the participant spent draining jobs
+    };
+
+    static thread_local const ThreadPool* active_pool_;
+
+    const size_t thread_cnt_;
+    const bool pin_workers_;// the thread calling run_parallel keeps its own affinity
+    std::unique_ptr<Queue[]> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex submit_mut_;
+    std::mutex mut_;
+    std::condition_variable wake_;
+    size_t generation_ = 0;
+    bool stop_ = false;
+
+    alignas(64) std::atomic<int> remaining_{0};
+
+    // the first exception thrown by a range of the current job, rethrown on the caller
+    std::mutex failure_mut_;
+    std::exception_ptr failure_;
+    std::atomic<bool> failed_{false};
+
+    // owner takes its ranges in order from the front
+    bool pop(const size_t index, Range& range) {
+        std::lock_guard<std::mutex> lock(queues_[index].mut);
+        if (queues_[index].ranges.empty()) {
+            return false;
+        }
+        range = queues_[index].ranges.front();
+        queues_[index].ranges.pop_front();
+        return true;
+    }
+
+    // thieves take from the back, away from the owner
+    bool steal(const size_t thief, Range& range) {
+        for (size_t offset = 1; offset < thread_cnt_; ++offset) {
+            Queue& victim = queues_[(thief + offset) % thread_cnt_];
+            std::lock_guard<std::mutex> lock(victim.mut);
+            if (!victim.ranges.empty()) {
+                range = victim.ranges.back();
+                victim.ranges.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void drain(const size_t index) {
+        Range range;
+        while (pop(index, range) || steal(index, range)) {
+            // once a range has thrown the rest of the job is only counted off
+            if (!failed_.load(std::memory_order_relaxed)) {
+                try {
+                    range.task->call(range.task->job, range.first, range.last);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(failure_mut_);
+                    if (!failure_) {
+                        failure_ = std::current_exception();
+                        failed_.store(true, std::memory_order_relaxed);
+                    }
+                }
+            }
+            remaining_.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    // the clock is read once per job and participant, not per range
+    void timed_drain(const size_t index) {
+        auto begin = std::chrono::steady_clock::now();
+        drain(index);
+        auto busy = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin);
+        queues_[index].busy_ns.fetch_add(busy.count(), std::memory_order_relaxed);
+    }
+
+    // participants spread evenly over the allowed CPUs
+    void pin(const size_t index) const {
+#ifdef __linux__
+        std::vector<int> cpus = NumaTopology::get().cpu_order();
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[index * cpus.size() / thread_cnt_], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+
+    void work(const size_t index) {
+        active_pool_ = this;
+        if (pin_workers_) {
+            pin(index);
+        }
+        size_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mut_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_) {
+                    return;
+                }
+                seen = generation_;
+            }
+            timed_drain(index);
+        }
+    }
+};
+
+thread_local const ThreadPool* ThreadPool::active_pool_ = nullptr;
+
+enum class MatrixLayout : uint32_t {
+    row_major = 0,
+    tiled = 1// block_height x block_width tiles in row-major order, each tile row-major, padded with zeros
+};
+
+enum class MatrixDType : uint32_t {
+    int32 = 1,
+    int8 = 2,
+    int64 = 3,
+    float32 = 4,
+    float64 = 5
+};
+
+template<typename T>
+constexpr MatrixDType dtype_of() {
+    if constexpr (std::is_same_v<T, int32_t>) {
+        return MatrixDType::int32;
+    } else if constexpr (std::is_same_v<T, int8_t>) {
+        return MatrixDType::int8;
+    } else if constexpr (std::is_same_v<T, int64_t>) {
+        return MatrixDType::int64;
+    } else if constexpr (std::is_same_v<T, float>) {
+        return MatrixDType::float32;
+    } else {
+        static_assert(std::is_same_v<T, double>, "no file format for this element type");
+        return MatrixDType::float64;
+    }
+}
+
+// Binary matrix file: this header, then the cells. 64 bytes long so tiles that follow it
+// in a mapping keep the alignment of Block
+struct MatrixFileHeader {
+    char magic[4] = {'M', 'A', 'T', 'R'};
+    uint32_t version = 1;
+    MatrixDType dtype = MatrixDType::int32;
+    MatrixLayout layout = MatrixLayout::tiled;
+    uint64_t height = 0;
+    uint64_t width = 0;
+    uint32_t block_size = 0;
+    char reserved[28] = {};
+
+    bool valid() const {
+        return magic[0] == 'M' && magic[1] == 'A' && magic[2] == 'T' && magic[3] == 'R' && version == 1;
+    }
+};
+
+static_assert(sizeof(MatrixFileHeader) == 64, "header must keep tiles cache line aligned");
+
+// Whole file mmapped. Private mappings are copy-on-write, so they may be handed out as writable storage.
+// advice is the madvise hint for how the pages will be read
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path, const bool writable_copy = false, const int advice = MADV_NORMAL) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot open " + path);
+        }
+        struct stat info{};
+        if (fstat(fd, &info) != 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "cannot stat " + path);
+        }
+        size_ = static_cast<size_t>(info.st_size);
+        if (size_ > 0) {
+            void* data = mmap(nullptr, size_, writable_copy ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE,
+                              fd, 0);
+            if (data == MAP_FAILED) {
+                int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "cannot mmap " + path);
+            }
+            data_ = static_cast<char*>(data);
+            madvise(data_, size_, advice);
+        }
+        ::close(fd);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_) {
+            munmap(data_, size_);
+        }
+    }
+
+    char* data() const noexcept { return data_; }
+
+    size_t size() const noexcept { return size_; }
+
+    // caller becomes responsible for munmap(data(), size())
+    char* release() noexcept {
+        char* data = data_;
+        data_ = nullptr;
+        return data;
+    }
+
+private:
+    char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+enum class MulAlgorithm {
+    gemm,
+    strassen// Strassen-Winograd for square operands, falls back to gemm otherwise
+};
+
+template<typename T, typename Acc = T>
+class Matrix;
+
+template<typename T, typename Acc = T>
+class SparseMatrix;
+
+template<typename T>
+class LazySum;
+
+// gemm epilogue that leaves finished tiles as they are
+struct NoEpilogue {
+    template<typename Tile>
+    void operator()(Tile&, int, int) const {}
+};
+
+template<typename T>
+struct alignas(64) Block {// a whole number of cache lines for every element type
+
+    Block() = default;
+
+    ~Block() = default;
+
+    T matr[block_size][block_size] = {};
+
+    // this += first * second in place, T is the accumulator type of the product
+    template<typename U>
+    Block& multiply_add(const Block<U>& first, const Block<U>& second) {
+        TileKernel<U, T>::multiply_add(matr, first.matr, second.matr);
+        return *this;
+    }
+
+    friend Block operator*(const Block& first, const Block& second) {
+        Block result;
+        result.multiply_add(first, second);
+        return result;
+    }
+};
+
+// Tiled matrix file read and written a run of tiles at a time, for matrices that are never resident as a whole
+template<typename T>
+class TileFile {
+public:
+    // an existing tiled file of T
+    explicit TileFile(const std::string& path) :
+            path_(path) {
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot open " + path);
+        }
+        try {
+            transfer(reinterpret_cast<char*>(&header_), sizeof(header_), 0, false);
+        } catch (...) {
+            ::close(fd_);
+            throw;
+        }
+        if (!header_.valid() || header_.layout != MatrixLayout::tiled || header_.dtype != dtype_of<T>() ||
+            header_.block_size != block_size) {
+            ::close(fd_);
+            throw std::runtime_error(path + ": not a tiled matrix of this element type with block size " +
+                                     std::to_string(block_size));
+        }
+        struct stat info{};
+        if (fstat(fd_, &info) != 0 || static_cast<uint64_t>(info.st_size) < offset(block_height(), 0)) {
+            ::close(fd_);
+            throw std::runtime_error(path + ": truncated");
+        }
+    }
+
+    // a new height x width tiled file, every tile reads as zeros until it is written
+    TileFile(const std::string& path, const uint64_t height, const uint64_t width) :
+            path_(path) {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot create " + path);
+        }
+        header_.dtype = dtype_of<T>();
+        header_.height = height;
+        header_.width = width;
+        header_.block_size = block_size;
+        try {
+            transfer(reinterpret_cast<char*>(&header_), sizeof(header_), 0, true);
+            if (ftruncate(fd_, static_cast<off_t>(offset(block_height(), 0))) != 0) {
+                throw std::system_error(errno, std::generic_category(), "cannot resize " + path);
+            }
+        } catch (...) {
+            ::close(fd_);
+            throw;
+        }
+    }
+
+    TileFile(const TileFile&) = delete;
+
+    TileFile& operator=(const TileFile&) = delete;
+
+    ~TileFile() {
+        ::close(fd_);
+    }
+
+    uint64_t height() const noexcept { return header_.height; }
+
+    uint64_t width() const noexcept { return header_.width; }
+
+    uint64_t block_height() const noexcept { return (header_.height + block_size - 1) / block_size; }
+
+    uint64_t block_width() const noexcept { return (header_.width + block_size - 1) / block_size; }
+
+    // count tiles of tile row i from tile column j on
+    void read(const uint64_t i, const uint64_t j, const uint64_t count, Block<T>* tiles) const {
+        transfer(reinterpret_cast<char*>(tiles), sizeof(Block<T>) * count, offset(i, j), false);
+    }
+
+    void write(const uint64_t i, const uint64_t j, const uint64_t count, const Block<T>* tiles) {
+        transfer(reinterpret_cast<char*>(const_cast<Block<T>*>(tiles)), sizeof(Block<T>) * count, offset(i, j), true);
+    }
+
+private:
+    std::string path_;
+    int fd_ = -1;
+    MatrixFileHeader header_;
+
+    uint64_t offset(const uint64_t i, const uint64_t j) const {
+        return sizeof(MatrixFileHeader) + sizeof(Block<T>) * (i * block_width() + j);
+    }
+
+    // pread/pwrite until all of it is through, they may stop short
+    void transfer(char* data, size_t bytes, uint64_t position, const bool writing) const {
+        while (bytes > 0) {
+            ssize_t done = writing ? pwrite(fd_, data, bytes, static_cast<off_t>(position))
+                                   : pread(fd_, data, bytes, static_cast<off_t>(position));
+            if (done < 0 && errno == EINTR) {
+                continue;
+            }
+            if (done < 0) {
+                throw std::system_error(errno, std::generic_category(),
+                                        (writing ? "cannot write " : "cannot read ") + path_);
+            }
+            if (done == 0) {
+                throw std::runtime_error(path_ + ": truncated");
+            }
+            data += done;
+            bytes -= static_cast<size_t>(done);
+            position += static_cast<uint64_t>(done);
+        }
+    }
+};
+
+// Tiled storage: block_height_ x block_width_ tiles in row-major order, padded with zeros
+template<typename T>
+class BlockMatr {
+private:
+    template<typename U>
+    friend class BlockMatr;
+
+    template<typename U, typename V>
+    friend class Matrix;
+
+    template<typename U, typename V>
+    friend class SparseMatrix;
+
+    template<typename U>
+    friend class LazySum;
+
+
+    int height_;
+    int width_;
+    int block_height_ = height_ / block_size;
+    int block_width_ = width_ / block_size;
+
+    // tiles either come from new[] or live offset bytes into a mapping: a file after its header, or anonymous pages
+    struct Storage {
+        size_t mapped_bytes = 0;
+        size_t offset = 0;
+
+        void operator()(Block<T>* tiles) const {
+            if (mapped_bytes) {
+                munmap(reinterpret_cast<char*>(tiles) - offset, mapped_bytes);
+            } else {
+                delete[] tiles;
+            }
+        }
+    };
+
+    std::unique_ptr<Block<T>[], Storage> block_matr_;// block_height_ x block_width_ tiles, row-major, one allocation
+
+    Block<T>& block(const int i, const int j) { return block_matr_[i * block_width_ + j]; }
+
+    const Block<T>& block(const int i, const int j) const { return block_matr_[i * block_width_ + j]; }
+
+
+    // Packed B panel of the calling thread with room for nc x kc tiles. It is kept between multiplies,
+    // so a gemm maps, binds and first-touches its pages only when it needs a bigger or differently placed one
+    static Block<T>* packed_panel(const int nc, const int kc, ThreadPool& pool, const Placement placement) {
+        struct Scratch {
+            std::unique_ptr<BlockMatr> panel;
+            const ThreadPool* pool = nullptr;
+            Placement placement = Placement::local;
+        };
+        static thread_local Scratch scratch;
+
+        BlockMatr* panel = scratch.panel.get();
+        if (!panel || panel->block_height_ < nc || panel->block_width_ < kc || scratch.pool != &pool ||
+            scratch.placement != placement) {
+            const int height = panel && scratch.pool == &pool ? std::max(nc, panel->block_height_) : nc;
+            const int width = panel && scratch.pool == &pool ? std::max(kc, panel->block_width_) : kc;
+            scratch.panel.reset();
+            scratch.panel = std::make_unique<BlockMatr>(height * block_size, width * block_size, pool, placement);
+            scratch.pool = &pool;
+            scratch.placement = placement;
+        }
+        return scratch.panel->block_matr_.get();
+    }
+
+    // Packed A panel of the calling worker with room for count tiles, kept like the B panel,
+    // so it is allocated and zeroed only when a gemm needs a bigger one
+    static Block<T>* packed_rows(const int count) {
+        static thread_local std::unique_ptr<Block<T>[]> rows;
+        static thread_local int capacity = 0;
+        if (capacity < count) {
+            rows.reset();
+            rows.reset(new Block<T>[count]);
+            capacity = count;
+        }
+        return rows.get();
+    }
+
+    // result += first * second, epilogue(tile, i, j) runs on every result tile right after its last k panel
+    template<typename Acc, typename Epilogue = NoEpilogue>
+    static void gemm(BlockMatr<Acc>& result, const BlockMatr& first, const BlockMatr& second, ThreadPool& pool,
+                     const GemmConfig& config, const Epilogue& epilogue = Epilogue()) {
+        const int m = first.block_height_;
+        const int k = first.block_width_;
+        const int n = second.block_width_;
+
+        // an empty inner dimension adds nothing, but every tile still gets its epilogue
+        if (k == 0) {
+            pool.run_parallel(m, [&](const int first_row, const int last_row) {
+                for (int i = first_row; i <= last_row; ++i) {
+                    for (int j = 0; j < n; ++j) {
+                        epilogue(result.block(i, j), i, j);
+                    }
+                }
+            });
+            return;
+        }
+
+        // smaller A panels when there are not enough of them to feed every thread
+        const int thread_cnt = static_cast<int>(pool.get_thread_cnt());
+        const int per_thread = (m + thread_cnt - 1) / thread_cnt;
+        const int mc = std::max(1, std::min(config.mc, per_thread));
+        const int kc = std::min(config.kc, k);
+        const int nc = std::min(config.nc, n);
+        const int panels_cnt = (m + mc - 1) / mc;
+
+        // B panel, column strips of kc tiles laid out one after another
+        Block<T>* packed_second = packed_panel(nc, kc, pool, config.packed_placement);
+
+        for (int jc = 0; jc < n; jc += nc) {
+            const int nb = std::min(nc, n - jc);
+
+            for (int pc = 0; pc < k; pc += kc) {
+                const int kb = std::min(kc, k - pc);
+                const bool finishes_tiles = pc + kb == k;
+
+                pool.run_parallel(nb, [&](const int first_strip, const int last_strip) {
+                    for (int jr = first_strip; jr <= last_strip; ++jr) {
+                        for (int p = 0; p < kb; ++p) {
+                            packed_second[jr * kb + p] = second.block(pc + p, jc + jr);
+                        }
+                    }
+                });
+
+                pool.run_parallel(panels_cnt, [&](const int first_panel, const int last_panel) {
+                    Block<T>* packed_first = packed_rows(mc * kb);
+
+                    for (int panel = first_panel; panel <= last_panel; ++panel) {
+                        const int ic = panel * mc;
+                        const int mb = std::min(mc, m - ic);
+
+                        for (int ir = 0; ir < mb; ++ir) {
+                            std::copy(&first.block(ic + ir, pc), &first.block(ic + ir, pc) + kb,
+                                      &packed_first[ir * kb]);
+                        }
+
+                        // one B strip stays in L1 while it meets every row of the A panel
+                        for (int jr = 0; jr < nb; ++jr) {
+                            const Block<T>* strip = &packed_second[jr * kb];
+                            for (int ir = 0; ir < mb; ++ir) {
+                                const Block<T>* row = &packed_first[ir * kb];
+                                Block<Acc>& dst = result.block(ic + ir, jc + jr);
+                                for (int p = 0; p < kb; ++p) {
+                                    dst.multiply_add(row[p], strip[p]);
+                                }
+                                if (finishes_tiles) {
+                                    epilogue(dst, ic + ir, jc + jr);
+                                }
+                            }
+                        }
+                    }
+                });
+            }
+        }
+    }
+
+public:
+
+    T& get_by_index(const int i, const int j) {
+        return block(i / block_size, j / block_size).matr[i % block_size][j % block_size];
+    }
+
+    const T& get_by_index(const int i, const int j) const {
+        return block(i / block_size, j / block_size).matr[i % block_size][j % block_size];
+    }
+
+    BlockMatr(const int height, const int width) :
+            height_(height),
+            width_(width),
+            block_height_((height_ % block_size) ? height_ / block_size + 1 : height_ / block_size),
+            block_width_((width_ % block_size) ? width_ / block_size + 1 : width_ / block_size),
+            block_matr_(new Block<T>[block_height_ * block_width_], Storage{}) {}
+
+    BlockMatr(const int height, const int width, ThreadPool& pool, const Placement placement) :
+            BlockMatr(height, width, nullptr, Storage{}) {
+        const size_t bytes = sizeof(Block<T>) * block_height_ * block_width_;
+        if (placement == Placement::local || bytes == 0) {
+            block_matr_.reset(new Block<T>[block_height_ * block_width_]);
+            return;
+        }
+
+        char* pages = map_pages(bytes);
+        block_matr_ = std::unique_ptr<Block<T>[], Storage>(reinterpret_cast<Block<T>*>(pages), Storage{bytes, 0});
+        if (placement == Placement::interleaved) {
+            interleave_pages(pages, bytes);
+        }
+        // the same split of tile rows run_parallel gives the gemm A panels
+        pool.run_parallel(block_height_, [&](const int first_row, const int last_row) {
+            std::uninitialized_value_construct_n(&block(first_row, 0), (last_row - first_row + 1) * block_width_);
+        });
+    }
+
+
+    BlockMatr(const int height, const int width, Block<T>* tiles, const Storage storage) :
+            height_(height),
+            width_(width),
+            block_height_((height_ % block_size) ? height_ / block_size + 1 : height_ / block_size),
+            block_width_((width_ % block_size) ? width_ / block_size + 1 : width_ / block_size),
+            block_matr_(tiles, storage) {}
+
+    // maps a tiled binary file as the tile storage itself, nothing is read or copied up front
+    static BlockMatr map(const std::string& path) {
+        MappedFile file(path, true, MADV_WILLNEED);// operands are read in gemm's order, not the file's
+        MatrixFileHeader header;
+        if (file.size() < sizeof(header)) {
+            throw std::runtime_error(path + ": not a matrix file");
+        }
+        std::copy(file.data(), file.data() + sizeof(header), reinterpret_cast<char*>(&header));
+        if (!header.valid() || header.layout != MatrixLayout::tiled || header.dtype != dtype_of<T>() ||
+            header.block_size != block_size) {
+            throw std::runtime_error(path + ": not a tiled matrix of this element type with block size " +
+                                     std::to_string(block_size));
+        }
+
+        // tiles are indexed with int, so the tile count has to fit as well as each dimension
+        const uint64_t tile_rows = (header.height + block_size - 1) / block_size;
+        const uint64_t tile_cols = (header.width + block_size - 1) / block_size;
+        constexpr uint64_t int_max = std::numeric_limits<int>::max();
+        if (header.height > int_max || header.width > int_max || (tile_cols && tile_rows > int_max / tile_cols)) {
+            throw std::runtime_error(path + ": dimensions out of range");
+        }
+
+        BlockMatr result(static_cast<int>(header.height), static_cast<int>(header.width), nullptr, Storage{});
+        size_t tiles_bytes = sizeof(Block<T>) * result.block_height_ * result.block_width_;
+        if (file.size() < sizeof(header) + tiles_bytes) {
+            throw std::runtime_error(path + ": truncated");
+        }
+
+        size_t mapped_bytes = file.size();
+        result.block_matr_ = std::unique_ptr<Block<T>[], Storage>(
+                reinterpret_cast<Block<T>*>(file.release() + sizeof(header)), Storage{mapped_bytes, sizeof(header)});
+        return result;
+    }
+
+    BlockMatr clone() const {
+        BlockMatr result(height_, width_);
+        std::copy(block_matr_.get(), block_matr_.get() + block_height_ * block_width_, result.block_matr_.get());
+        return result;
+    }
+
+    void write(std::ostream& out) const {
+        out.write(reinterpret_cast<const char*>(block_matr_.get()),
+                  sizeof(Block<T>) * block_height_ * block_width_);
+    }
+
+    // rows x cols tiles of some bigger tile grid
+    struct TileView {
+        Block<T>* tiles;
+        int stride;
+        int rows;
+        int cols;
+
+        Block<T>& at(const int i, const int j) const { return tiles[i * stride + j]; }
+
+        TileView quarter(const int i, const int j) const {
+            return {tiles + i * (rows / 2) * stride + j * (cols / 2), stride, rows / 2, cols / 2};
+        }
+    };
+
+    // Tiles a Strassen step needs for itself: S1..S4, T1..T4 and P1..P7, each a quarter of the operand
+    static size_t strassen_step_tiles(const int size) {
+        return 15 * static_cast<size_t>(size / 2) * (size / 2);
+    }
+
+    // scratch a sequential recursion on size x size tiles needs, reused by all seven sub-products
+    static size_t strassen_scratch_tiles(const int size, const int crossover) {
+        if (size <= crossover || size % 2) {
+            return 0;
+        }
+        return strassen_step_tiles(size) + strassen_scratch_tiles(size / 2, crossover);
+    }
+
+    // Integer tiles are added modulo 2^n: Strassen's intermediate sums may overflow
+    // even when the product fits, wrapping keeps the final result exact
+    using Wrap = typename std::conditional_t<std::is_integral_v<T>, std::make_unsigned<T>, std::common_type<T>>::type;
+
+    template<typename Op>
+    static void combine(const TileView& dst, const TileView& first, const TileView& second, Op op) {
+        for (int i = 0; i < dst.rows; ++i) {
+            for (int j = 0; j < dst.cols; ++j) {
+                Block<T>& d = dst.at(i, j);
+                const Block<T>& a = first.at(i, j);
+                const Block<T>& b = second.at(i, j);
+                for (int r = 0; r < block_size; ++r) {
+                    for (int c = 0; c < block_size; ++c) {
+                        d.matr[r][c] = static_cast<T>(op(static_cast<Wrap>(a.matr[r][c]),
+                                                         static_cast<Wrap>(b.matr[r][c])));
+                    }
+                }
+            }
+        }
+    }
+
+    // dst = first * second with the tile kernel
+    static void multiply_tiles(const TileView& dst, const TileView& first, const TileView& second) {
+        for (int i = 0; i < dst.rows; ++i) {
+            for (int j = 0; j < dst.cols; ++j) {
+                dst.at(i, j) = Block<T>();
+            }
+            for (int k = 0; k < first.cols; ++k) {
+                for (int j = 0; j < dst.cols; ++j) {
+                    dst.at(i, j).multiply_add(first.at(i, k), second.at(k, j));
+                }
+            }
+        }
+    }
+
+    // dst = first * second, Strassen-Winograd on square views. Only the top level (pool != nullptr)
+    // runs its seven products in parallel, each with its own slice of the scratch arena
+    static void strassen(const TileView& dst, const TileView& first, const TileView& second, Block<T>* scratch,
+                         const int crossover, ThreadPool* pool) {
+        const int size = first.rows;
+        if (size <= crossover || size % 2) {
+            multiply_tiles(dst, first, second);
+            return;
+        }
+        const int half = size / 2;
+
+        TileView temp[15];
+        for (auto& view : temp) {
+            view = {scratch, half, half, half};
+            scratch += half * half;
+        }
+        TileView* s = temp;
+        TileView* t = temp + 4;
+        TileView* p = temp + 8;
+
+        auto plus = [](const Wrap a, const Wrap b) -> Wrap { return a + b; };
+        auto minus = [](const Wrap a, const Wrap b) -> Wrap { return a - b; };
+
+        TileView a11 = first.quarter(0, 0), a12 = first.quarter(0, 1);
+        TileView a21 = first.quarter(1, 0), a22 = first.quarter(1, 1);
+        TileView b11 = second.quarter(0, 0), b12 = second.quarter(0, 1);
+        TileView b21 = second.quarter(1, 0), b22 = second.quarter(1, 1);
+
+        combine(s[0], a21, a22, plus);
+        combine(s[1], s[0], a11, minus);
+        combine(s[2], a11, a21, minus);
+        combine(s[3], a12, s[1], minus);
+        combine(t[0], b12, b11, minus);
+        combine(t[1], b22, t[0], minus);
+        combine(t[2], b22, b12, minus);
+        combine(t[3], t[1], b21, minus);
+
+        const TileView factors[7][2] = {{a11, b11}, {a12, b21}, {s[3], b22}, {a22, t[3]},
+                                        {s[0], t[0]}, {s[1], t[1]}, {s[2], t[2]}};
+
+        if (pool) {
+            const size_t child_scratch = strassen_scratch_tiles(half, crossover);
+            pool->run_parallel(7, [&](const int first_product, const int last_product) {
+                for (int i = first_product; i <= last_product; ++i) {
+                    strassen(p[i], factors[i][0], factors[i][1], scratch + i * child_scratch, crossover, nullptr);
+                }
+            }, 1);
+        } else {
+            for (int i = 0; i < 7; ++i) {
+                strassen(p[i], factors[i][0], factors[i][1], scratch, crossover, nullptr);
+            }
+        }
+
+        // C11 = P1 + P2, C12 = P1 + P6 + P5 + P3, C21 = P1 + P6 + P7 - P4, C22 = P1 + P6 + P7 + P5
+        TileView c11 = dst.quarter(0, 0), c12 = dst.quarter(0, 1);
+        TileView c21 = dst.quarter(1, 0), c22 = dst.quarter(1, 1);
+        for (int i = 0; i < half; ++i) {
+            for (int j = 0; j < half; ++j) {
+                for (int r = 0; r < block_size; ++r) {
+                    for (int c = 0; c < block_size; ++c) {
+                        auto value = [&](const int product) {
+                            return static_cast<Wrap>(p[product].at(i, j).matr[r][c]);
+                        };
+                        Wrap u2 = value(0) + value(5);
+                        Wrap u3 = u2 + value(6);
+                        c11.at(i, j).matr[r][c] = static_cast<T>(value(0) + value(1));
+                        c12.at(i, j).matr[r][c] = static_cast<T>(u2 + value(4) + value(2));
+                        c21.at(i, j).matr[r][c] = static_cast<T>(u3 - value(3));
+                        c22.at(i, j).matr[r][c] = static_cast<T>(u3 + value(4));
+                    }
+                }
+            }
+        }
+    }
+
+    // result = first * second for square operands. Pads to crossover-sized blocks times a power of two
+    // and carves all scratch out of one arena allocated up front
+    static void strassen_multiply(BlockMatr& result, const BlockMatr& first, const BlockMatr& second,
+                                  ThreadPool& pool, const GemmConfig& config) {
+        const int crossover = std::max(1, config.strassen_crossover);
+        const int size = first.block_height_;
+
+        int padded = size;
+        int levels = 0;
+        while (padded > crossover) {
+            padded = (padded + 1) / 2;
+            ++levels;
+        }
+        padded <<= levels;
+
+        const int half = padded / 2;
+        const bool pad = padded != size;
+        const size_t operand_tiles = static_cast<size_t>(padded) * padded;
+        const size_t arena_tiles = (pad ? 3 * operand_tiles : 0) +
+                                   (levels ? strassen_step_tiles(padded) +
+                                             7 * strassen_scratch_tiles(half, crossover) : 0);
+        std::unique_ptr<Block<T>[]> arena(new Block<T>[arena_tiles]);
+
+        TileView a{first.block_matr_.get(), first.block_width_, size, size};
+        TileView b{second.block_matr_.get(), second.block_width_, size, size};
+        TileView c{result.block_matr_.get(), result.block_width_, size, size};
+        Block<T>* scratch = arena.get();
+        if (pad) {
+            TileView padded_a{scratch, padded, padded, padded};
+            TileView padded_b{scratch + operand_tiles, padded, padded, padded};
+            for (int i = 0; i < size; ++i) {
+                std::copy(&a.at(i, 0), &a.at(i, 0) + size, &padded_a.at(i, 0));
+                std::copy(&b.at(i, 0), &b.at(i, 0) + size, &padded_b.at(i, 0));
+            }
+            a = padded_a;
+            b = padded_b;
+            c = {scratch + 2 * operand_tiles, padded, padded, padded};
+            scratch += 3 * operand_tiles;
+        }
+
+        strassen(c, a, b, scratch, crossover, &pool);
+
+        if (pad) {
+            for (int i = 0; i < size; ++i) {
+                std::copy(&c.at(i, 0), &c.at(i, 0) + size, &result.block(i, 0));
+            }
+        }
+    }
+
+    // result = first * second between tiled files, in blocks of C small enough for memory_budget bytes of
+    // panel buffers. While the A and B panels of one k step are multiplied, a second thread reads the next ones
+    template<typename Acc>
+    static void stream_multiply(const TileFile<T>& first, const TileFile<T>& second, TileFile<Acc>& result,
+                                ThreadPool& pool, const GemmConfig& config, const size_t memory_budget) {
+        const int64_t m = static_cast<int64_t>(first.block_height());
+        const int64_t k = static_cast<int64_t>(first.block_width());
+        const int64_t n = static_cast<int64_t>(second.block_width());
+        if (m == 0 || k == 0 || n == 0) {
+            return;
+        }
+
+        // t x t tiles per panel: two A and two B panels in flight plus the C block
+        const double per_tile = 4.0 * sizeof(Block<T>) + sizeof(Block<Acc>);
+        const int64_t side = std::max<int64_t>(1, static_cast<int64_t>(std::sqrt(memory_budget / per_tile)));
+        const int mb = static_cast<int>(std::min(side, m));
+        const int kb = static_cast<int>(std::min(side, k));
+        const int nb = static_cast<int>(std::min(side, n));
+
+        BlockMatr first_buffers[2] = {BlockMatr(mb * block_size, kb * block_size),
+                                      BlockMatr(mb * block_size, kb * block_size)};
+        BlockMatr second_buffers[2] = {BlockMatr(kb * block_size, nb * block_size),
+                                       BlockMatr(kb * block_size, nb * block_size)};
+        BlockMatr<Acc> block(mb * block_size, nb * block_size);
+
+        struct Step {
+            int64_t ic;
+            int64_t jc;
+            int64_t pc;
+        };
+        std::vector<Step> steps;
+        for (int64_t ic = 0; ic < m; ic += mb) {
+            for (int64_t jc = 0; jc < n; jc += nb) {
+                for (int64_t pc = 0; pc < k; pc += kb) {
+                    steps.push_back({ic, jc, pc});
+                }
+            }
+        }
+
+        // partial panels at the edges are zero padded, the padding adds nothing to the product
+        auto load = [&](const Step& step, const int buffer) {
+            const int rows = static_cast<int>(std::min<int64_t>(mb, m - step.ic));
+            const int depth = static_cast<int>(std::min<int64_t>(kb, k - step.pc));
+            const int cols = static_cast<int>(std::min<int64_t>(nb, n - step.jc));
+            BlockMatr& a = first_buffers[buffer];
+            BlockMatr& b = second_buffers[buffer];
+            if (rows < mb || depth < kb) {
+                std::fill(a.block_matr_.get(), a.block_matr_.get() + mb * kb, Block<T>());
+            }
+            if (depth < kb || cols < nb) {
+                std::fill(b.block_matr_.get(), b.block_matr_.get() + kb * nb, Block<T>());
+            }
+            for (int r = 0; r < rows; ++r) {
+                first.read(step.ic + r, step.pc, depth, &a.block(r, 0));
+            }
+            for (int p = 0; p < depth; ++p) {
+                second.read(step.pc + p, step.jc, cols, &b.block(p, 0));
+            }
+        };
+
+        // One reader thread for the whole product runs up to two steps ahead, each into the buffer pair
+        // the compute side has finished with
+        std::mutex mut;
+        std::condition_variable changed;
+        size_t loaded = 0;
+        size_t consumed = 0;
+        bool stopped = false;
+        std::exception_ptr read_error;
+
+        std::thread reader([&] {
+            for (size_t s = 0; s < steps.size(); ++s) {
+                {
+                    std::unique_lock<std::mutex> lock(mut);
+                    changed.wait(lock, [&] { return stopped || s < consumed + 2; });
+                    if (stopped) {
+                        return;
+                    }
+                }
+                try {
+                    load(steps[s], static_cast<int>(s % 2));
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mut);
+                    read_error = std::current_exception();
+                    changed.notify_all();
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(mut);
+                loaded = s + 1;
+                changed.notify_all();
+            }
+        });
+        // the reader is stopped and joined however the compute side leaves
+        struct ReaderGuard {
+            std::thread& reader;
+            std::mutex& mut;
+            std::condition_variable& changed;
+            bool& stopped;
+
+            ~ReaderGuard() {
+                {
+                    std::lock_guard<std::mutex> lock(mut);
+                    stopped = true;
+                }
+                changed.notify_all();
+                reader.join();
+            }
+        } guard{reader, mut, changed, stopped};
+
+        for (size_t s = 0; s < steps.size(); ++s) {
+            {
+                std::unique_lock<std::mutex> lock(mut);
+                changed.wait(lock, [&] { return loaded > s || read_error; });
+                if (loaded <= s) {
+                    std::rethrow_exception(read_error);
+                }
+            }
+
+            const Step& step = steps[s];
+            if (step.pc == 0) {
+                std::fill(block.block_matr_.get(), block.block_matr_.get() + mb * nb, Block<Acc>());
+            }
+            gemm(block, first_buffers[s % 2], second_buffers[s % 2], pool, config);
+            {
+                std::lock_guard<std::mutex> lock(mut);
+                consumed = s + 1;
+            }
+            changed.notify_all();
+
+            if (step.pc + kb >= k) {
+                const int rows = static_cast<int>(std::min<int64_t>(mb, m - step.ic));
+                const int cols = static_cast<int>(std::min<int64_t>(nb, n - step.jc));
+                for (int r = 0; r < rows; ++r) {
+                    result.write(step.ic + r, step.jc, cols, &block.block(r, 0));
+                }
+            }
+        }
+    }
+
+    // first * second accumulated in Acc. Strassen needs subtraction in the element type itself,
+    // so mixed-precision products always take the gemm path
+    template<typename Acc>
+    static BlockMatr<Acc> multiply(const BlockMatr& first, const BlockMatr& second, ThreadPool& pool,
+                                   const GemmConfig& config, const MulAlgorithm algorithm = MulAlgorithm::gemm) {
+        BlockMatr<Acc> result(first.height_, second.width_, pool, config.result_placement);
+
+        if constexpr (std::is_same_v<T, Acc>) {
+            if (algorithm == MulAlgorithm::strassen && first.height_ == first.width_ &&
+                first.width_ == second.height_ && second.height_ == second.width_) {
+                strassen_multiply(result, first, second, pool, config);
+                return result;
+            }
+        }
+        gemm(result, first, second, pool, config);
+
+        return result;
+    }
+
+    // result += first * second on the calling thread, for products small enough to stay in cache
+    template<typename Acc>
+    static void multiply_small(BlockMatr<Acc>& result, const BlockMatr& first, const BlockMatr& second) {
+        for (int i = 0; i < first.block_height_; ++i) {
+            for (int p = 0; p < first.block_width_; ++p) {
+                const Block<T>& tile = first.block(i, p);
+                for (int j = 0; j < second.block_width_; ++j) {
+                    result.block(i, j).multiply_add(tile, second.block(p, j));
+                }
+            }
+        }
+    }
+
+    // y = this * x with x zero padded to whole tiles. The tiles are streamed once; every tile row keeps
+    // partial sums per lane and reduces them only when the row ends, so the inner loop is elementwise
+    template<typename Acc>
+    void gemv(const T* x, Acc* y, ThreadPool& pool) const {
+        pool.run_parallel(block_height_, [&](const int first_row, const int last_row) {
+            for (int i = first_row; i <= last_row; ++i) {
+                Acc partial[block_size][block_size] = {};
+                for (int j = 0; j < block_width_; ++j) {
+                    const Block<T>& tile = block(i, j);
+                    const T* segment = x + j * block_size;
+                    for (int r = 0; r < block_size; ++r) {
+                        for (int c = 0; c < block_size; ++c) {
+                            partial[r][c] += static_cast<Acc>(tile.matr[r][c]) * static_cast<Acc>(segment[c]);
+                        }
+                    }
+                }
+                for (int r = 0; r < block_size && i * block_size + r < height_; ++r) {
+                    y[i * block_size + r] = std::accumulate(partial[r], partial[r] + block_size, Acc(0));
+                }
+            }
+        });
+    }
+};
+
+// Non-owning views of a Matrix, valid as long as the matrix is. Nothing is copied:
+// both read the tiles the matrix is stored in
+template<typename T>
+struct TiledView {
+    const Block<T>* tiles;
+    int block_height;
+    int block_width;
+
+    const Block<T>& tile(const int i, const int j) const { return tiles[i * block_width + j]; }
+};
+
+template<typename T>
+struct RowMajorView {
+    TiledView<T> tiled;
+    int height;
+    int width;
+
+    const T& operator()(const int i, const int j) const {
+        return tiled.tile(i / block_size, j / block_size).matr[i % block_size][j % block_size];
+    }
+
+    // block_size consecutive cells of row i from column tile_col * block_size on, zeros past width
+    const T* segment(const int i, const int tile_col) const {
+        return tiled.tile(i / block_size, tile_col).matr[i % block_size];
+    }
+};
+
+// Dense matrix of T, stored tiled. Products accumulate in Acc and come out as Matrix<Acc>,
+// e.g. Matrix<int8_t, int32_t>
+template<typename T, typename Acc>
+class Matrix {
+private:
+    static inline GemmConfig gemm_config_ = GemmConfig::tuned(sizeof(Block<T>));
+
+    BlockMatr<T> data_;
+
+    explicit Matrix(BlockMatr<T>&& data) :
+            data_(std::move(data)),
+            height_(data_.height_),
+            width_(data_.width_) {}
+
+    // Legacy text files: the mapped text is cut into one chunk per thread at whitespace,
+    // chunks count their numbers, then parse them straight into place
+    void load_text(const std::string& path, ThreadPool& pool) {
+        MappedFile file(path, false, MADV_SEQUENTIAL);
+        const char* text = file.data();
+        const size_t size = file.size();
+        const int chunks_cnt = static_cast<int>(pool.get_thread_cnt());
+
+        auto is_space = [](const char c) { return std::isspace(static_cast<unsigned char>(c)) != 0; };
+
+        std::vector<size_t> bounds(chunks_cnt + 1, size);
+        for (int c = 0; c < chunks_cnt; ++c) {
+            size_t bound = size * c / chunks_cnt;
+            while (bound > 0 && bound < size && !is_space(text[bound - 1])) {
+                ++bound;
+            }
+            bounds[c] = bound;
+        }
+
+        std::vector<size_t> offsets(chunks_cnt + 1, 0);
+        pool.run_parallel(chunks_cnt, [&](const int first_chunk, const int last_chunk) {
+            for (int c = first_chunk; c <= last_chunk; ++c) {
+                size_t cnt = 0;
+                for (size_t pos = bounds[c]; pos < bounds[c + 1]; ++pos) {
+                    if (!is_space(text[pos]) && (pos == bounds[c] || is_space(text[pos - 1]))) {
+                        ++cnt;
+                    }
+                }
+                offsets[c + 1] = cnt;
+            }
+        }, 1);
+        for (int c = 0; c < chunks_cnt; ++c) {
+            offsets[c + 1] += offsets[c];
+        }
+
+        const size_t cells_cnt = static_cast<size_t>(height_) * width_;
+        if (offsets.back() < cells_cnt) {
+            throw std::runtime_error(path + ": expected " + std::to_string(cells_cnt) + " numbers, found " +
+                                     std::to_string(offsets.back()));
+        }
+        if (cells_cnt == 0) {
+            return;
+        }
+
+        std::atomic<bool> malformed(false);
+        pool.run_parallel(chunks_cnt, [&](const int first_chunk, const int last_chunk) {
+            for (int c = first_chunk; c <= last_chunk; ++c) {
+                size_t cnt = offsets[c];
+                int row = static_cast<int>(cnt / width_);
+                int col = static_cast<int>(cnt % width_);
+                const char* pos = text + bounds[c];
+                const char* end = text + bounds[c + 1];
+                while (cnt < cells_cnt) {
+                    while (pos < end && is_space(*pos)) {
+                        ++pos;
+                    }
+                    if (pos == end) {
+                        break;
+                    }
+                    T value = 0;
+                    auto [next, error] = std::from_chars(pos, end, value);
+                    if (error != std::errc() || (next != end && !is_space(*next))) {
+                        malformed.store(true, std::memory_order_relaxed);
+                        return;
+                    }
+                    data_.get_by_index(row, col) = value;
+                    ++cnt;
+                    if (++col == width_) {
+                        col = 0;
+                        ++row;
+                    }
+                    pos = next;
+                }
+            }
+        }, 1);
 
-class Timer {
-public:
-    Timer() {
-        begin = std::chrono::steady_clock::now();
+        if (malformed.load()) {
+            throw std::runtime_error(path + ": malformed number");
+        }
     }
 
-    ~Timer() {
-        auto end = std::chrono::steady_clock::now();
-        auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin);
-        std::cout << elapsed_ms.count() << " ms" << std::endl;
+public:
+
+    const int height_ = 0;
+    const int width_ = 0;
+
+    Matrix(const int height, const int width) :
+            data_(height, width),
+            height_(height),
+            width_(width) {}
+
+    // tiles placed across NUMA nodes for the workers of pool, see Placement
+    Matrix(const int height, const int width, ThreadPool& pool, const Placement placement = Placement::first_touch) :
+            data_(height, width, pool, placement),
+            height_(height),
+            width_(width) {}
+
+    Matrix(const Matrix& other) :
+            data_(other.data_.clone()),
+            height_(other.height_),
+            width_(other.width_) {}
+
+    Matrix(Matrix&& other) noexcept = default;
+
+    // maps a tiled binary file as the storage of the matrix, no copy is made
+    static Matrix map(const std::string& path) {
+        return Matrix(BlockMatr<T>::map(path));
     }
 
-private:
-    std::chrono::time_point<std::chrono::_V2::steady_clock, std::chrono::duration<long int, std::ratio<1, 1000000000>>>
-            begin;
+    T& operator()(const int i, const int j) { return data_.get_by_index(i, j); }
 
+    const T& operator()(const int i, const int j) const { return data_.get_by_index(i, j); }
 
-};
+    TiledView<T> tiled() const { return {data_.block_matr_.get(), data_.block_height_, data_.block_width_}; }
 
-constexpr int block_size = 8;
+    RowMajorView<T> rows() const { return {tiled(), height_, width_}; }
 
-class Matrix {
-private:
-    static size_t thread_cnt_;
+    static void set_gemm_config(const GemmConfig& config) noexcept { gemm_config_ = config; }
 
-    static size_t get_thread_cnt() { return thread_cnt_; }
+    static const GemmConfig& get_gemm_config() noexcept { return gemm_config_; }
 
-    struct BlockMatr {
-    private:
+    template<typename U, typename V>
+    friend Matrix<V> multiply(const Matrix<U, V>& first, const Matrix<U, V>& second, ThreadPool& pool,
+                              MulAlgorithm algorithm);
 
-        struct alignas(64) Block {// sizeof = 28
+    template<typename U, typename V>
+    friend std::vector<V> multiply(const Matrix<U, V>& matrix, const std::vector<U>& vector, ThreadPool& pool);
 
-            Block() = default;
+    template<typename U, typename V>
+    friend std::vector<Matrix<V>> multiply_batch(const std::vector<Matrix<U, V>>& firsts,
+                                                 const std::vector<Matrix<U, V>>& seconds, ThreadPool& pool);
 
-            ~Block() = default;
+    template<typename U, typename V>
+    friend class Matrix;
 
-            std::vector<std::vector<int>> matr =
-                    std::vector<std::vector<int>>(block_size,
-                                                  std::vector<int>(block_size, 0));//string will fit in line
+    template<typename U, typename V>
+    friend class SparseMatrix;
 
-            char padding[36];
+    template<typename U>
+    friend class LazySum;
 
-            friend Block operator*(const Block& first, const Block& second) {
+    void print() const {
+        for (int i = 0; i < height_; ++i) {
+            for (int j = 0; j < width_; ++j) {
+                std::cout << +(*this)(i, j) << ' ';
+            }
+            std::cout << std::endl;
+        }
+    }
 
-                Block result;
-                for (int i = 0; i < block_size; ++i) {
-                    for (int k = 0; k < block_size; ++k) {
-                        int r = first.matr[i][k];
-                        for (int j = 0; j < block_size; ++j) {
-                            result.matr[i][j] += r * second.matr[k][j];
-                        }
-                    }
-                }
+    // Reads either a binary matrix file or whitespace separated text into this matrix.
+    // Throws if the file cannot be read, does not match the size or is malformed
+    void load(const std::string& path, ThreadPool& pool = ThreadPool::instance()) {
+        MatrixFileHeader header;
+        {
+            std::ifstream fin(path, std::ios::binary);
+            if (fin.fail()) {
+                throw std::runtime_error("cannot open " + path);
+            }
+            fin.read(reinterpret_cast<char*>(&header), sizeof(header));
+            if (fin.gcount() != sizeof(header) || !header.valid()) {
+                load_text(path, pool);
+                return;
+            }
+        }
 
-                /*
-                Block transposed_second = second.get_transposed();
+        if (header.height != static_cast<uint64_t>(height_) || header.width != static_cast<uint64_t>(width_)) {
+            throw std::runtime_error(path + ": size mismatch");
+        }
+        if (header.dtype != dtype_of<T>()) {
+            throw std::runtime_error(path + ": unsupported element type");
+        }
+        if (header.layout != MatrixLayout::row_major &&
+            (header.layout != MatrixLayout::tiled || header.block_size == 0)) {
+            throw std::runtime_error(path + ": unknown layout");
+        }
 
-                for (int i = 0; i < block_size; ++i) {
-                    for (int j = 0; j < block_size; ++j) {
-                        for (int k = 0; k < block_size; ++k) {
-                            result.matr[i][j] += first.matr[i][k] * transposed_second.matr[j][k];
-                        }
-                    }
-                }*/
-                return result;
+        if (header.layout == MatrixLayout::tiled && header.block_size == block_size) {
+            data_ = BlockMatr<T>::map(path);
+            return;
+        }
+
+        MappedFile file(path, false, MADV_WILLNEED);
+        const size_t tile = header.layout == MatrixLayout::tiled ? header.block_size : 0;
+        const size_t tiles_width = tile ? (width_ + tile - 1) / tile : 0;
+        const size_t cells_cnt = tile ? tile * tile * tiles_width * ((height_ + tile - 1) / tile)
+                                      : static_cast<size_t>(height_) * width_;
+        if (file.size() < sizeof(header) + cells_cnt * sizeof(T)) {
+            throw std::runtime_error(path + ": truncated");
+        }
+
+        const char* cells = file.data() + sizeof(header);
+        pool.run_parallel(height_, [&](const int first_row, const int last_row) {
+            for (int i = first_row; i <= last_row; ++i) {
+                for (int j = 0; j < width_; ++j) {
+                    size_t index = tile ? ((i / tile) * tiles_width + j / tile) * tile * tile + (i % tile) * tile + j % tile
+                                        : static_cast<size_t>(i) * width_ + j;
+                    T value;
+                    std::copy(cells + index * sizeof(value), cells + (index + 1) * sizeof(value),
+                              reinterpret_cast<char*>(&value));
+                    data_.get_by_index(i, j) = value;
+                }
             }
+        });
+    }
 
-            Block& operator+=(const Block& other) {
-                for (int i = 0; i < block_size; ++i) {
-                    for (int j = 0; j < block_size; ++j) {
-                        matr[i][j] += other.matr[i][j];
-                    }
+    void save(const std::string& path, const MatrixLayout layout = MatrixLayout::tiled) const {
+        std::ofstream fout(path, std::ios::binary | std::ios::trunc);
+        if (fout.fail()) {
+            throw std::runtime_error("cannot create " + path);
+        }
+
+        MatrixFileHeader header;
+        header.dtype = dtype_of<T>();
+        header.layout = layout;
+        header.height = height_;
+        header.width = width_;
+        header.block_size = layout == MatrixLayout::tiled ? block_size : 0;
+        fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        if (layout == MatrixLayout::tiled) {
+            data_.write(fout);
+        } else {
+            RowMajorView<T> view = rows();
+            for (int i = 0; i < height_; ++i) {
+                for (int tile_col = 0; tile_col < data_.block_width_; ++tile_col) {
+                    int cells = std::min(block_size, width_ - tile_col * block_size);
+                    fout.write(reinterpret_cast<const char*>(view.segment(i, tile_col)), sizeof(T) * cells);
                 }
-                return *this;
             }
+        }
 
-            Block get_transposed() const {
-                Block result;
-                for (int i = 0; i < block_size; ++i) {
-                    for (int j = 0; j < block_size; ++j) {
-                        result.matr[i][j] = matr[j][i];
-                    }
+        if (fout.fail()) {
+            throw std::runtime_error("cannot write " + path);
+        }
+    }
+
+    bool operator==(const Matrix& other) const {
+        if (height_ != other.height_ || width_ != other.width_) {
+            return false;
+        }
+        RowMajorView<T> view = rows();
+        RowMajorView<T> other_view = other.rows();
+        for (int i = 0; i < height_; ++i) {
+            for (int tile_col = 0; tile_col < data_.block_width_; ++tile_col) {
+                int cells = std::min(block_size, width_ - tile_col * block_size);
+                if (!std::equal(view.segment(i, tile_col), view.segment(i, tile_col) + cells,
+                                other_view.segment(i, tile_col))) {
+                    return false;
                 }
-                return result;
             }
-        };
+        }
+        return true;
+    }
 
-        int height_;
-        int width_;
-        int block_height_ = height_ / block_size;
-        int block_width_ = width_ / block_size;
+};
 
-        std::vector<std::vector<Block>> block_matr_;
+template<typename T, typename Acc>
+Matrix<Acc> multiply(const Matrix<T, Acc>& first, const Matrix<T, Acc>& second, ThreadPool& pool,
+                     const MulAlgorithm algorithm = MulAlgorithm::gemm) {
+    if (first.width_ != second.height_) {
+        throw std::invalid_argument("matrix product: " + std::to_string(first.height_) + "x" +
+                                    std::to_string(first.width_) + " times " + std::to_string(second.height_) +
+                                    "x" + std::to_string(second.width_));
+    }
+    BlockMatr<Acc> result = BlockMatr<T>::template multiply<Acc>(first.data_, second.data_, pool,
+                                                                Matrix<T, Acc>::gemm_config_, algorithm);
 
+    return Matrix<Acc>(std::move(result));
+}
 
-        std::vector<std::pair<int, int>> prepare_job() {
-            int total = block_height_ * block_width_;
-            int cells_per_thread = total / Matrix::thread_cnt_;
-            std::vector<int> distribution(Matrix::thread_cnt_, cells_per_thread);
+template<typename T, typename Acc>
+Matrix<Acc> operator*(const Matrix<T, Acc>& first, const Matrix<T, Acc>& second) {
+    return multiply(first, second, ThreadPool::instance());
+}
 
+// matrix * vector, a bandwidth bound pass over the matrix tiles
+template<typename T, typename Acc>
+std::vector<Acc> multiply(const Matrix<T, Acc>& matrix, const std::vector<T>& vector,
+                          ThreadPool& pool = ThreadPool::instance()) {
+    if (vector.size() != static_cast<size_t>(matrix.width_)) {
+        throw std::invalid_argument("vector of " + std::to_string(vector.size()) + " entries for a matrix " +
+                                    std::to_string(matrix.width_) + " wide");
+    }
+    std::vector<T> padded(vector);
+    padded.resize((matrix.width_ + block_size - 1) / block_size * block_size);
 
-            for (int i = 0, rest = total % Matrix::thread_cnt_; rest > 0; ++i, --rest) {
-                ++distribution[i];
-            }
+    std::vector<Acc> result(matrix.height_);
+    matrix.data_.gemv(padded.data(), result.data(), pool);
+    return result;
+}
+
+// firsts[b] * seconds[b] for many small independent pairs in one parallel dispatch. Every participant
+// takes whole products and multiplies them straight from the tiles, without gemm's packing and panels
+template<typename T, typename Acc>
+std::vector<Matrix<Acc>> multiply_batch(const std::vector<Matrix<T, Acc>>& firsts,
+                                        const std::vector<Matrix<T, Acc>>& seconds,
+                                        ThreadPool& pool = ThreadPool::instance()) {
+    if (firsts.size() != seconds.size()) {
+        throw std::invalid_argument("batch of " + std::to_string(firsts.size()) + " left and " +
+                                    std::to_string(seconds.size()) + " right operands");
+    }
+    std::vector<Matrix<Acc>> results;
+    results.reserve(firsts.size());
+    for (size_t b = 0; b < firsts.size(); ++b) {
+        if (firsts[b].width_ != seconds[b].height_) {
+            throw std::invalid_argument("batch entry " + std::to_string(b) + ": inner dimensions differ");
+        }
+        results.emplace_back(firsts[b].height_, seconds[b].width_);
+    }
+
+    pool.run_parallel(static_cast<int>(firsts.size()), [&](const int first_product, const int last_product) {
+        for (int b = first_product; b <= last_product; ++b) {
+            BlockMatr<T>::multiply_small(results[b].data_, firsts[b].data_, seconds[b].data_);
+        }
+    });
+    return results;
+}
+
+// Out-of-core first * second between tiled files (Matrix::save with MatrixLayout::tiled). Only panels
+// of the operands and one block of the result are in memory at a time, about memory_budget bytes
+template<typename T, typename Acc = T>
+void multiply_files(const std::string& first_path, const std::string& second_path, const std::string& result_path,
+                    ThreadPool& pool, const size_t memory_budget = size_t(1) << 30) {
+    TileFile<T> first(first_path);
+    TileFile<T> second(second_path);
+    if (first.width() != second.height()) {
+        throw std::runtime_error(first_path + " and " + second_path + ": inner dimensions differ");
+    }
+    TileFile<Acc> result(result_path, first.height(), second.width());
+    BlockMatr<T>::template stream_multiply<Acc>(first, second, result, pool, Matrix<T, Acc>::get_gemm_config(),
+                                                memory_budget);
+}
+
+// Blocked CSR: only tiles with a non-zero cell are stored, row_ptr_[i]..row_ptr_[i + 1] index
+// the tiles of tile row i, col_idx_ holds their tile columns in increasing order
+template<typename T, typename Acc>
+class SparseMatrix {
+private:
+    int height_;
+    int width_;
+    int block_height_;
+    int block_width_;
 
-            std::vector<std::pair<int, int>> threads_work(Matrix::thread_cnt_);
-            for (int i = 0, current = 0; i < Matrix::thread_cnt_; ++i) {
-                threads_work[i].first = current;
-                current = current + distribution[i] - 1;
-                threads_work[i].second = current;
-                ++current;
+    std::vector<int> row_ptr_;
+    std::vector<int> col_idx_;
+    std::vector<Block<T>> tiles_;
+
+    template<typename U, typename V>
+    friend class SparseMatrix;
+
+    SparseMatrix(const int height, const int width) :
+            height_(height),
+            width_(width),
+            block_height_((height_ % block_size) ? height_ / block_size + 1 : height_ / block_size),
+            block_width_((width_ % block_size) ? width_ / block_size + 1 : width_ / block_size),
+            row_ptr_(block_height_ + 1, 0) {}
+
+    static bool is_zero(const Block<T>& tile) {
+        for (int r = 0; r < block_size; ++r) {
+            for (int c = 0; c < block_size; ++c) {
+                if (tile.matr[r][c] != T()) {
+                    return false;
+                }
             }
-            return threads_work;
         }
+        return true;
+    }
+
+    // glues rows built independently into CSR arrays
+    void assemble(std::vector<std::vector<int>>& cols, std::vector<std::vector<Block<T>>>& tiles) {
+        for (int i = 0; i < block_height_; ++i) {
+            row_ptr_[i + 1] = row_ptr_[i] + static_cast<int>(cols[i].size());
+        }
+        col_idx_.reserve(row_ptr_.back());
+        tiles_.reserve(row_ptr_.back());
+        for (int i = 0; i < block_height_; ++i) {
+            col_idx_.insert(col_idx_.end(), cols[i].begin(), cols[i].end());
+            tiles_.insert(tiles_.end(), tiles[i].begin(), tiles[i].end());
+        }
+    }
 
-    public:
+public:
+    // keeps the non-zero tiles of a dense matrix
+    explicit SparseMatrix(const Matrix<T, Acc>& matrix, ThreadPool& pool = ThreadPool::instance()) :
+            SparseMatrix(matrix.height_, matrix.width_) {
+        const BlockMatr<T>& dense = matrix.data_;
+
+        std::vector<std::vector<int>> cols(block_height_);
+        std::vector<std::vector<Block<T>>> tiles(block_height_);
+        pool.run_parallel(block_height_, [&](const int first_row, const int last_row) {
+            for (int i = first_row; i <= last_row; ++i) {
+                for (int j = 0; j < block_width_; ++j) {
+                    if (!is_zero(dense.block(i, j))) {
+                        cols[i].push_back(j);
+                        tiles[i].push_back(dense.block(i, j));
+                    }
+                }
+            }
+        });
+        assemble(cols, tiles);
+    }
 
-        int& get_by_index(const int i, const int j) {
-            return block_matr_[i / block_size][j / block_size].matr[i % block_size][j % block_size];
+    // builds straight from (row, column, value) entries, memory is proportional to the touched tiles
+    SparseMatrix(const int height, const int width, std::vector<std::tuple<int, int, T>> entries) :
+            SparseMatrix(height, width) {
+        auto tile_of = [](const std::tuple<int, int, T>& entry) {
+            return std::make_pair(std::get<0>(entry) / block_size, std::get<1>(entry) / block_size);
+        };
+        std::sort(entries.begin(), entries.end(), [&](const auto& first, const auto& second) {
+            return tile_of(first) < tile_of(second);
+        });
+
+        for (size_t pos = 0; pos < entries.size(); ++pos) {
+            auto [row, col, value] = entries[pos];
+            if (row < 0 || row >= height_ || col < 0 || col >= width_) {
+                throw std::out_of_range("sparse entry outside the matrix");
+            }
+            if (pos == 0 || tile_of(entries[pos - 1]) != tile_of(entries[pos])) {
+                col_idx_.push_back(col / block_size);
+                tiles_.emplace_back();
+                ++row_ptr_[row / block_size + 1];
+            }
+            tiles_.back().matr[row % block_size][col % block_size] = value;
         }
+        for (int i = 0; i < block_height_; ++i) {
+            row_ptr_[i + 1] += row_ptr_[i];
+        }
+    }
+
+    int get_height() const noexcept { return height_; }
+
+    int get_width() const noexcept { return width_; }
 
-        const int& get_by_index(const int i, const int j) const {
-            return block_matr_[i / block_size][j / block_size].matr[i % block_size][j % block_size];
+    size_t nonzero_tiles() const noexcept { return tiles_.size(); }
+
+    Matrix<T, Acc> to_dense() const {
+        BlockMatr<T> dense(height_, width_);
+        for (int i = 0; i < block_height_; ++i) {
+            for (int p = row_ptr_[i]; p < row_ptr_[i + 1]; ++p) {
+                dense.block(i, col_idx_[p]) = tiles_[p];
+            }
         }
+        return Matrix<T, Acc>(std::move(dense));
+    }
 
-        BlockMatr(const Matrix& matrix) :
-                height_(matrix.height_),
-                width_(matrix.width_),
-                block_height_((height_ % block_size) ? height_ / block_size + 1 : height_ / block_size),
-                block_width_((width_ % block_size) ? width_ / block_size + 1 : width_ / block_size),
-                block_matr_(std::vector<std::vector<Block>>(block_height_, std::vector<Block>(block_width_))) {
+    // sparse x dense: every tile row of the result walks only the stored tiles of its row in first
+    static Matrix<Acc> multiply(const SparseMatrix& first, const Matrix<T, Acc>& second, ThreadPool& pool) {
+        if (first.width_ != second.height_) {
+            throw std::invalid_argument("sparse x dense: inner dimensions differ");
+        }
+        const BlockMatr<T>& dense = second.data_;
+        BlockMatr<Acc> result(first.height_, second.width_, pool, Matrix<T, Acc>::gemm_config_.result_placement);
+
+        pool.run_parallel(first.block_height_, [&](const int first_row, const int last_row) {
+            for (int i = first_row; i <= last_row; ++i) {
+                for (int p = first.row_ptr_[i]; p < first.row_ptr_[i + 1]; ++p) {
+                    const int k = first.col_idx_[p];
+                    for (int j = 0; j < result.block_width_; ++j) {
+                        result.block(i, j).multiply_add(first.tiles_[p], dense.block(k, j));
+                    }
+                }
+            }
+        });
 
+        return Matrix<Acc>(std::move(result));
+    }
 
+    // sparse x sparse, Gustavson's row by row algorithm over tiles: tile row i of the result
+    // gathers first(i, k) * second(k, j) into a dense row of accumulators, touching only stored tiles
+    static SparseMatrix<Acc> multiply(const SparseMatrix& first, const SparseMatrix& second, ThreadPool& pool) {
+        if (first.width_ != second.height_) {
+            throw std::invalid_argument("sparse x sparse: inner dimensions differ");
+        }
+        SparseMatrix<Acc> result(first.height_, second.width_);
+        const int width = second.block_width_;
+
+        std::vector<std::vector<int>> cols(first.block_height_);
+        std::vector<std::vector<Block<Acc>>> tiles(first.block_height_);
+        pool.run_parallel(first.block_height_, [&](const int first_row, const int last_row) {
+            std::unique_ptr<Block<Acc>[]> accumulator(new Block<Acc>[width]);
+            std::vector<int> marker(width, -1);
+
+            for (int i = first_row; i <= last_row; ++i) {
+                for (int p = first.row_ptr_[i]; p < first.row_ptr_[i + 1]; ++p) {
+                    const int k = first.col_idx_[p];
+                    for (int q = second.row_ptr_[k]; q < second.row_ptr_[k + 1]; ++q) {
+                        const int j = second.col_idx_[q];
+                        if (marker[j] != i) {
+                            marker[j] = i;
+                            accumulator[j] = Block<Acc>();
+                            cols[i].push_back(j);
+                        }
+                        accumulator[j].multiply_add(first.tiles_[p], second.tiles_[q]);
+                    }
+                }
 
-            for (int i = 0; i < matrix.height_; ++i) {
-                for (int j = 0; j < matrix.width_; ++j) {
-                    this->get_by_index(i, j) = matrix.matr_[i][j];
+                std::sort(cols[i].begin(), cols[i].end());
+                tiles[i].reserve(cols[i].size());
+                for (int j : cols[i]) {
+                    tiles[i].push_back(accumulator[j]);
                 }
             }
+        });
+        result.assemble(cols, tiles);
+        return result;
+    }
+};
+
+template<typename T, typename Acc>
+Matrix<Acc> multiply(const SparseMatrix<T, Acc>& first, const Matrix<T, Acc>& second,
+                     ThreadPool& pool = ThreadPool::instance()) {
+    return SparseMatrix<T, Acc>::multiply(first, second, pool);
+}
+
+template<typename T, typename Acc>
+SparseMatrix<Acc> multiply(const SparseMatrix<T, Acc>& first, const SparseMatrix<T, Acc>& second,
+                           ThreadPool& pool = ThreadPool::instance()) {
+    return SparseMatrix<T, Acc>::multiply(first, second, pool);
+}
+
+
+// Lazy expressions: lazy(a) * b * c records the chain instead of multiplying it,
+// scalars and negation fold into alpha, eval() or adding or subtracting a term turns it into a LazySum.
+// Operands are only pointed to, so they have to outlive the expression: temporaries are refused
+template<typename T>
+class LazyProduct {
+private:
+    std::vector<const Matrix<T>*> factors_;
+    T alpha_ = 1;
+
+    friend class LazySum<T>;
+
+    int height() const { return factors_.front()->height_; }
+
+    int width() const { return factors_.back()->width_; }
+
+    // shapes are checked while the expression is built, eval() relies on them
+    static void check_chain(const LazyProduct& first, const LazyProduct& second) {
+        if (first.width() != second.height()) {
+            throw std::invalid_argument("lazy product: inner dimensions differ");
         }
+    }
+
+public:
+    explicit LazyProduct(const Matrix<T>& matrix) : factors_{&matrix} {}
 
-        BlockMatr(const int height, const int width) :
-                height_(height),
-                width_(width),
-                block_height_((height_ % block_size) ? height_ / block_size + 1 : height_ / block_size),
-                block_width_((width_ % block_size) ? width_ / block_size + 1 : width_ / block_size),
-                block_matr_(std::vector<std::vector<Block>>(block_height_, std::vector<Block>(block_width_))) {}
+    explicit LazyProduct(const Matrix<T>&&) = delete;
 
+    friend LazyProduct operator*(LazyProduct first, const LazyProduct& second) {
+        check_chain(first, second);
+        first.factors_.insert(first.factors_.end(), second.factors_.begin(), second.factors_.end());
+        first.alpha_ *= second.alpha_;
+        return first;
+    }
 
-        friend BlockMatr operator*(const BlockMatr& first, const BlockMatr& second) {
-            Matrix::BlockMatr result(first.height_, second.width_);
+    friend LazyProduct operator*(LazyProduct first, const Matrix<T>& second) {
+        check_chain(first, LazyProduct(second));
+        first.factors_.push_back(&second);
+        return first;
+    }
 
-            auto threads_work = result.prepare_job();
+    friend LazyProduct operator*(LazyProduct, const Matrix<T>&&) = delete;
 
-            auto job = [&](const int first_elem, const int last_elem) {
-                for (int cnt = first_elem; cnt <= last_elem; ++cnt) {
-                    int i = cnt % result.block_height_;
-                    int j = cnt / result.block_width_;
+    friend LazyProduct operator*(LazyProduct product, const T scalar) {
+        product.alpha_ *= scalar;
+        return product;
+    }
 
-                    for (int k = 0; k < first.block_width_; ++k) {
-                        result.block_matr_[i][j] += (first.block_matr_[i][k] * second.block_matr_[k][j]);
-                    }
-                }
-            };
+    friend LazyProduct operator*(const T scalar, LazyProduct product) {
+        product.alpha_ *= scalar;
+        return product;
+    }
+
+    friend LazySum<T> operator+(const LazyProduct& first, const LazyProduct& second) {
+        return LazySum<T>(first, second);
+    }
 
-            if (Matrix::thread_cnt_ > 1) {
+    friend LazySum<T> operator+(const LazyProduct& first, const Matrix<T>& second) {
+        return LazySum<T>(first, LazyProduct(second));
+    }
+
+    friend LazySum<T> operator+(const LazyProduct&, const Matrix<T>&&) = delete;
+
+    friend LazyProduct operator-(LazyProduct product) {
+        product.alpha_ = -product.alpha_;
+        return product;
+    }
+
+    friend LazySum<T> operator-(const LazyProduct& first, const LazyProduct& second) {
+        return LazySum<T>(first, -second);
+    }
+
+    friend LazySum<T> operator-(const LazyProduct& first, const Matrix<T>& second) {
+        return first - LazyProduct(second);
+    }
 
-                std::vector<std::thread> workers(Matrix::thread_cnt_ - 1);
+    friend LazySum<T> operator-(const LazyProduct&, const Matrix<T>&&) = delete;
 
-                for (int i = 0; i < Matrix::thread_cnt_ - 1; ++i) {
-                    workers[i] = std::thread(job, threads_work[i].first, threads_work[i].second);
+    Matrix<T> eval(ThreadPool& pool = ThreadPool::instance()) const {
+        return LazySum<T>(*this).eval(pool);
+    }
+};
+
+template<typename T>
+LazyProduct<T> lazy(const Matrix<T>& matrix) {
+    return LazyProduct<T>(matrix);
+}
+
+template<typename T>
+LazyProduct<T> lazy(const Matrix<T>&&) = delete;
+
+// alpha * (a * b * ...) + addend. The product is evaluated in the association order with the fewest
+// multiply-adds (matrix chain DP), intermediates are tiles like the operands and alpha and the addend are applied
+// by the last gemm to each result tile while it is still in cache
+template<typename T>
+class LazySum {
+private:
+    LazyProduct<T> product_;
+    std::vector<LazyProduct<T>> addends_;
+
+    // alpha * tile + sum of beta * addend tile
+    struct Epilogue {
+        T alpha;
+        std::vector<std::pair<T, const BlockMatr<T>*>> addends;
+
+        void operator()(Block<T>& tile, const int i, const int j) const {
+            for (int r = 0; r < block_size; ++r) {
+                for (int c = 0; c < block_size; ++c) {
+                    T value = alpha * tile.matr[r][c];
+                    for (auto& [beta, addend] : addends) {
+                        value += beta * addend->block(i, j).matr[r][c];
+                    }
+                    tile.matr[r][c] = value;
                 }
+            }
+        }
+    };
 
-                job(threads_work.back().first, threads_work.back().second);
+    // Operands are used in place, only intermediates are allocated. A deque,
+    // so references handed out stay valid while more is added
+    struct Workspace {
+        std::deque<BlockMatr<T>> temporaries;
+    };
 
-                for (auto& worker : workers) {
-                    if (worker.joinable()) {
-                        worker.join();
+    // split[i][j]: where the cheapest bracketing of factors i..j splits
+    static std::vector<std::vector<int>> chain_order(const std::vector<const Matrix<T>*>& factors) {
+        const int n = static_cast<int>(factors.size());
+        std::vector<unsigned long long> dims(n + 1);
+        for (int i = 0; i < n; ++i) {
+            dims[i] = factors[i]->height_;
+        }
+        dims[n] = factors.back()->width_;
+
+        std::vector<std::vector<unsigned long long>> cost(n, std::vector<unsigned long long>(n, 0));
+        std::vector<std::vector<int>> split(n, std::vector<int>(n, 0));
+        for (int length = 2; length <= n; ++length) {
+            for (int i = 0; i + length - 1 < n; ++i) {
+                int j = i + length - 1;
+                cost[i][j] = ~0ULL;
+                for (int s = i; s < j; ++s) {
+                    unsigned long long c = cost[i][s] + cost[s + 1][j] + dims[i] * dims[s + 1] * dims[j + 1];
+                    if (c < cost[i][j]) {
+                        cost[i][j] = c;
+                        split[i][j] = s;
                     }
                 }
+            }
+        }
+        return split;
+    }
 
-            } else {
-                job(threads_work.back().first, threads_work.back().second);
+    template<typename Epilogue>
+    static BlockMatr<T> evaluate(const std::vector<const Matrix<T>*>& factors,
+                                 const std::vector<std::vector<int>>& split, const int first, const int last,
+                                 Workspace& workspace, ThreadPool& pool, const Epilogue& epilogue) {
+        const int s = split[first][last];
+        auto operand = [&](const int from, const int to) -> const BlockMatr<T>& {
+            if (from == to) {
+                return factors[from]->data_;
             }
+            workspace.temporaries.push_back(evaluate(factors, split, from, to, workspace, pool, NoEpilogue()));
+            return workspace.temporaries.back();
+        };
+        const BlockMatr<T>& left = operand(first, s);
+        const BlockMatr<T>& right = operand(s + 1, last);
 
+        BlockMatr<T> result(factors[first]->height_, factors[last]->width_, pool,
+                            Matrix<T>::gemm_config_.result_placement);
+        BlockMatr<T>::gemm(result, left, right, pool, Matrix<T>::gemm_config_, epilogue);
+        return result;
+    }
 
+    // product with its own alpha, the epilogue carries the rest
+    static BlockMatr<T> evaluate(const LazyProduct<T>& product, Workspace& workspace, ThreadPool& pool,
+                                 Epilogue epilogue) {
+        const auto& factors = product.factors_;
+        epilogue.alpha *= product.alpha_;
+
+        if (factors.size() == 1) {
+            const BlockMatr<T>& source = factors[0]->data_;
+            BlockMatr<T> result(source.height_, source.width_);
+            pool.run_parallel(result.block_height_, [&](const int first_row, const int last_row) {
+                for (int i = first_row; i <= last_row; ++i) {
+                    for (int j = 0; j < result.block_width_; ++j) {
+                        result.block(i, j) = source.block(i, j);
+                        epilogue(result.block(i, j), i, j);
+                    }
+                }
+            });
             return result;
         }
-    };
 
-    void copy_from_block_matr(const BlockMatr& block_matrix) {
-        for (int i = 0; i < height_; ++i) {
-            for (int j = 0; j < width_; ++j) {
-                matr_[i][j] = block_matrix.get_by_index(i, j);
-            }
-        }
+        auto split = chain_order(factors);
+        return evaluate(factors, split, 0, static_cast<int>(factors.size()) - 1, workspace, pool, epilogue);
     }
 
-    friend BlockMatr operator*(const BlockMatr& first, const BlockMatr& second);
+    void check_term(const LazyProduct<T>& addend) const {
+        if (addend.height() != product_.height() || addend.width() != product_.width()) {
+            throw std::invalid_argument("lazy sum: term dimensions differ");
+        }
+    }
 
 public:
+    explicit LazySum(const LazyProduct<T>& product) : product_(product) {}
 
-    const int height_ = 0;
-    const int width_ = 0;
-    std::vector<std::vector<int>> matr_;
+    LazySum(const LazyProduct<T>& product, const LazyProduct<T>& addend) : product_(product), addends_{addend} {
+        check_term(addend);
+    }
 
-    Matrix(const int height, const int width) :
-            height_(height),
-            width_(width),
-            matr_(std::vector<std::vector<int>>(height_, std::vector<int>(width_, 0))) {}
+    friend LazySum operator+(LazySum sum, const LazyProduct<T>& addend) {
+        sum.check_term(addend);
+        sum.addends_.push_back(addend);
+        return sum;
+    }
 
-    static void set_thread_cnt(const size_t thread_cnt) noexcept { thread_cnt_ = thread_cnt; }
+    friend LazySum operator+(LazySum sum, const Matrix<T>& addend) {
+        return sum + LazyProduct<T>(addend);
+    }
 
-    friend Matrix operator*(const Matrix& first, const Matrix& second);
+    friend LazySum operator+(LazySum, const Matrix<T>&&) = delete;
 
-    void print() {
-        for (int i = 0; i < height_; ++i) {
-            for (int j = 0; j < width_; ++j) {
-                std::cout << matr_[i][j] << ' ';
-            }
-            std::cout << std::endl;
-        }
+    friend LazySum operator-(LazySum sum, const LazyProduct<T>& addend) {
+        return sum + -addend;
+    }
+
+    friend LazySum operator-(LazySum sum, const Matrix<T>& addend) {
+        return sum - LazyProduct<T>(addend);
     }
 
-    void load(const std::string& path) {
-        std::ifstream fin(path);
-        if (fin.fail()) {
-            exit(1);
+    friend LazySum operator-(LazySum, const Matrix<T>&&) = delete;
+
+    Matrix<T> eval(ThreadPool& pool = ThreadPool::instance()) const {
+        Workspace workspace;
+
+        // the longest chain gets the fused epilogue, plain matrices among the other terms feed it directly
+        size_t main = 0;
+        for (size_t i = 0; i < addends_.size(); ++i) {
+            if (addends_[i].factors_.size() > (main ? addends_[main - 1] : product_).factors_.size()) {
+                main = i + 1;
+            }
         }
-        for (int cnt = 0, cells_cnt = height_ * width_; cnt < cells_cnt; ++cnt) {
-            fin >> matr_[cnt / height_][cnt % width_];
+        const LazyProduct<T>& product = main ? addends_[main - 1] : product_;
+
+        Epilogue epilogue{T(1), {}};
+        for (size_t i = 0; i <= addends_.size(); ++i) {
+            if (i == main) {
+                continue;
+            }
+            const LazyProduct<T>& term = i ? addends_[i - 1] : product_;
+            if (term.factors_.size() == 1) {
+                epilogue.addends.emplace_back(term.alpha_, &term.factors_[0]->data_);
+            } else {
+                workspace.temporaries.push_back(evaluate(term, workspace, pool, Epilogue{T(1), {}}));
+                epilogue.addends.emplace_back(T(1), &workspace.temporaries.back());
+            }
         }
+
+        return Matrix<T>(evaluate(product, workspace, pool, epilogue));
     }
+};
 
-    bool operator==(const Matrix& other) {
-        for (int i = 0; i < height_; ++i) {
-            for (int j = 0; j < width_; ++j) {
-                if (matr_[i][j] != other.matr_[i][j]) {
-                    return false;
+
+// Bytes gemm moves to and from memory, assuming every packed panel is reused from cache:
+// A is streamed once per nc column panel, B once plus its packed copy, C read and written per kc panel
+template<typename T, typename Acc>
+double gemm_traffic_bytes(const int m, const int k, const int n, const GemmConfig& config) {
+    auto tiles = [](const int cells) { return static_cast<double>((cells + block_size - 1) / block_size); };
+    double mt = tiles(m), kt = tiles(k), nt = tiles(n);
+    double column_panels = std::ceil(nt / std::min<double>(config.nc, nt));
+    double k_panels = std::ceil(kt / std::min<double>(config.kc, kt));
+    return sizeof(Block<T>) * (mt * kt * column_panels + 2 * kt * nt) + sizeof(Block<Acc>) * mt * nt * 2 * k_panels;
+}
+
+// Sustained memory bandwidth of the pool in bytes per second, measured like the STREAM triad:
+// a = b + s * c over arrays far larger than the caches, best of several passes, counting
+// the two arrays read and the one written
+double measure_bandwidth(ThreadPool& pool, const int cells = 1 << 23, const int passes = 5) {
+    std::unique_ptr<double[]> a(new double[cells]);
+    std::unique_ptr<double[]> b(new double[cells]);
+    std::unique_ptr<double[]> c(new double[cells]);
+    // first touch by the participants that stream the same ranges later
+    pool.run_parallel(cells, [&](const int first, const int last) {
+        std::fill(&a[first], &a[last] + 1, 0.0);
+        std::fill(&b[first], &b[last] + 1, 1.0);
+        std::fill(&c[first], &c[last] + 1, 2.0);
+    });
+
+    double best = std::numeric_limits<double>::max();
+    for (int pass = 0; pass < passes; ++pass) {
+        auto begin = std::chrono::steady_clock::now();
+        pool.run_parallel(cells, [&](const int first, const int last) {
+            for (int i = first; i <= last; ++i) {
+                a[i] = b[i] + 3.0 * c[i];
+            }
+        });
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+    }
+    return 3.0 * sizeof(double) * cells / best;
+}
+
+// Operations per second the tile kernel reaches with its operands in L1, on every participant at once,
+// best of several passes: the compute roof for gemm on this pool
+template<typename T, typename Acc>
+double measure_peak_ops(ThreadPool& pool, const int calls = 1 << 16, const int passes = 5) {
+    const int participants = static_cast<int>(pool.get_thread_cnt());
+    std::vector<Block<Acc>> results(participants);
+
+    double best = std::numeric_limits<double>::max();
+    for (int pass = 0; pass < passes; ++pass) {
+        auto begin = std::chrono::steady_clock::now();
+        pool.run_parallel(participants, [&](const int first, const int last) {
+            for (int t = first; t <= last; ++t) {
+                Block<T> left, right;
+                for (int r = 0; r < block_size; ++r) {
+                    for (int c = 0; c < block_size; ++c) {
+                        left.matr[r][c] = static_cast<T>((r + c + t) % 3);
+                        right.matr[r][c] = static_cast<T>((r * c) % 3);
+                    }
+                }
+                Block<Acc> acc;
+                for (int call = 0; call < calls; ++call) {
+                    acc.multiply_add(left, right);
                 }
+                results[t] = acc;
             }
-        }
-        return true;
+        }, 1);
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
     }
+    return 2.0 * block_size * block_size * block_size * calls * participants / best;
+}
 
+struct BenchmarkShape {
+    const char* name;
+    int m;
+    int k;
+    int n;
 };
 
-size_t Matrix::thread_cnt_;
+struct BenchmarkResult {
+    double median_seconds;
+    double min_seconds;
+    double imbalance;// slowest participant's busy time over the mean, 1 is perfectly even
+};
 
-Matrix operator*(const Matrix& first, const Matrix& second) {
+// Generated operands of the given shape multiplied repeat times after a warm-up run
+template<typename T>
+BenchmarkResult benchmark(const BenchmarkShape& shape, ThreadPool& pool, const int repeat) {
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> value(-100, 100);
+    Matrix<T> first(shape.m, shape.k, pool);
+    Matrix<T> second(shape.k, shape.n, pool, Placement::interleaved);
+    for (int i = 0; i < shape.m; ++i) {
+        for (int j = 0; j < shape.k; ++j) {
+            first(i, j) = static_cast<T>(value(gen));
+        }
+    }
+    for (int i = 0; i < shape.k; ++i) {
+        for (int j = 0; j < shape.n; ++j) {
+            second(i, j) = static_cast<T>(value(gen));
+        }
+    }
 
-    Matrix::BlockMatr bm_first(first);
-    Matrix::BlockMatr bm_second(second);
+    multiply(first, second, pool);
+    pool.reset_busy();
 
-    Matrix::BlockMatr bm_result = bm_first * bm_second;
+    std::vector<double> seconds;
+    for (int run = 0; run < repeat; ++run) {
+        auto begin = std::chrono::steady_clock::now();
+        multiply(first, second, pool);
+        seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+    }
+    std::sort(seconds.begin(), seconds.end());
 
-    Matrix result(first.height_, second.width_);
-    result.copy_from_block_matr(bm_result);
+    std::vector<double> busy = pool.busy_seconds();
+    double mean = std::accumulate(busy.begin(), busy.end(), 0.0) / static_cast<double>(busy.size());
+    double imbalance = mean > 0 ? *std::max_element(busy.begin(), busy.end()) / mean : 1.0;
 
-    return result;
+    return {seconds[seconds.size() / 2], seconds.front(), imbalance};
 }
 
+// Small jobs submitted back to back, so workers still draining one job race with the next submit.
+// Every index has to run exactly once and every run_parallel has to return
+bool stress_thread_pool(const size_t thread_cnt, const int rounds) {
+    ThreadPool pool(std::max<size_t>(2, thread_cnt));
+    for (int round = 0; round < rounds; ++round) {
+        const int total = 1 + round % 64;
+        std::atomic<int> covered{0};
+        pool.run_parallel(total, [&](const int first, const int last) {
+            covered.fetch_add(last - first + 1, std::memory_order_relaxed);
+        }, 1 + round % 3);
+        if (covered.load() != total) {
+            return false;
+        }
+    }
+    return true;
+}
 
-int main() {
-    Matrix::set_thread_cnt(5);
-    Matrix m1(1'000, 1'000);
-    Matrix m2(1'000, 1'000);
-//    Matrix ans(100, 100);
+// Lazy expressions only point to their operands, so every way of handing them a temporary must not compile
+template<typename L, typename R>
+concept lazy_multipliable = requires { std::declval<L>() * std::declval<R>(); };
+
+template<typename L, typename R>
+concept lazy_addable = requires { std::declval<L>() + std::declval<R>(); };
+
+template<typename L, typename R>
+concept lazy_subtractable = requires { std::declval<L>() - std::declval<R>(); };
+
+template<typename M>
+concept lazy_wrappable = requires { lazy(std::declval<M>()); };
+
+static_assert(lazy_wrappable<const Matrix<int>&> && !lazy_wrappable<Matrix<int>>);
+static_assert(!std::is_constructible_v<LazyProduct<int>, Matrix<int>>);
+static_assert(lazy_multipliable<LazyProduct<int>, const Matrix<int>&>);
+static_assert(!lazy_multipliable<LazyProduct<int>, Matrix<int>>);
+static_assert(lazy_addable<LazyProduct<int>, const Matrix<int>&> && !lazy_addable<LazyProduct<int>, Matrix<int>>);
+static_assert(lazy_subtractable<LazyProduct<int>, const Matrix<int>&> &&
+              !lazy_subtractable<LazyProduct<int>, Matrix<int>>);
+static_assert(lazy_addable<LazySum<int>, const Matrix<int>&> && !lazy_addable<LazySum<int>, Matrix<int>>);
+static_assert(lazy_subtractable<LazySum<int>, const Matrix<int>&> && !lazy_subtractable<LazySum<int>, Matrix<int>>);
+
+// Small lazy sums of random shapes, the inner dimension empty every few rounds, set against plain loops.
+// A product with an empty inner dimension is all zeros, so the sum has to come out as the added matrix
+bool check_lazy(const int rounds) {
+    ThreadPool pool(std::max(2u, std::thread::hardware_concurrency()));
+    for (int round = 0; round < rounds; ++round) {
+        const int m = 1 + round % 37;
+        const int k = round % 4 ? 1 + round * 7 % 41 : 0;
+        const int n = 1 + round * 3 % 29;
+        Matrix<int> first(m, k), second(k, n), addend(m, n);
+        for (int i = 0; i < m; ++i) {
+            for (int p = 0; p < k; ++p) {
+                first(i, p) = (i * 3 + p + round) % 7 - 3;
+            }
+        }
+        for (int p = 0; p < k; ++p) {
+            for (int j = 0; j < n; ++j) {
+                second(p, j) = (p + j * 5 + round) % 9 - 4;
+            }
+        }
+        for (int i = 0; i < m; ++i) {
+            for (int j = 0; j < n; ++j) {
+                addend(i, j) = i - j + round;
+            }
+        }
 
-    std::string first("/home/artemiy/CLionProjects/Matrix/first.txt");
-    std::string second("/home/artemiy/CLionProjects/Matrix/second.txt");
-//    std::string result("/home/artemiy/CLionProjects/Matrix/ans.txt");
-    m1.load(first);
-    m2.load(second);
-//    ans.load(result);
+        Matrix<int> result = (lazy(first) * second * 2 + addend).eval(pool);
+        for (int i = 0; i < m; ++i) {
+            for (int j = 0; j < n; ++j) {
+                int expected = addend(i, j);
+                for (int p = 0; p < k; ++p) {
+                    expected += 2 * first(i, p) * second(p, j);
+                }
+                if (result(i, j) != expected) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
 
+// Sweeps size, shape, thread count and kc panel depth over generated int matrices. The tile size is
+// compile-time (MATRIX_BLOCK_SIZE), so it is a column to compare builds by rather than a sweep axis.
+// Every run is set against the roofline of its pool: the lower of the kernel's in-cache peak and the
+// measured triad bandwidth times the run's arithmetic intensity (operations per byte of modelled traffic),
+// next to the bandwidth the run achieved on that modelled traffic.
+// The CSV has one row per configuration in a fixed order, so two builds diff line by line.
+//   matrix [--sizes 256,512,1024] [--threads 1,2,4] [--repeat 5] [--csv results.csv]
+// --stress-pool N instead submits N small jobs back to back to one pool and checks every one completes.
+//   matrix --stress-pool 20000
+// --check-lazy N checks N lazy A * B * alpha + C sums of varying shapes against plain loops.
+//   matrix --check-lazy 200
+int main(int argc, char* argv[]) {
+    std::vector<int> sizes = {256, 512, 1024, 2048};
+    std::vector<int> thread_cnts;
+    for (int threads = 1; threads < static_cast<int>(std::thread::hardware_concurrency()); threads *= 2) {
+        thread_cnts.push_back(threads);
+    }
+    thread_cnts.push_back(static_cast<int>(std::max(1u, std::thread::hardware_concurrency())));
+    int repeat = 5;
+    int stress_rounds = 0;
+    int lazy_rounds = 0;
+    std::string csv_path;
+
+    try {
+        for (int i = 1; i < argc; i += 2) {
+            std::string option = argv[i];
+            if (i + 1 == argc) {
+                std::cerr << option << " needs a value" << std::endl;
+                return 1;
+            } else if (option == "--sizes") {
+                sizes = parse_int_list(argv[i + 1], 1, std::numeric_limits<int>::max());
+            } else if (option == "--threads") {
+                thread_cnts = parse_int_list(argv[i + 1], 1, std::numeric_limits<int>::max());
+            } else if (option == "--repeat") {
+                repeat = std::max(1, std::atoi(argv[i + 1]));
+            } else if (option == "--csv") {
+                csv_path = argv[i + 1];
+            } else if (option == "--stress-pool") {
+                stress_rounds = std::max(1, std::atoi(argv[i + 1]));
+            } else if (option == "--check-lazy") {
+                lazy_rounds = std::max(1, std::atoi(argv[i + 1]));
+            } else {
+                std::cerr << "unknown option " << option << std::endl;
+                return 1;
+            }
+        }
+    } catch (const std::invalid_argument& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
 
-    Timer* t = new Timer;
-    Matrix m3 = m1 * m2;
-    delete t;
-//    std::cout << std::boolalpha << (m3 == ans) << std::endl;
+    if (stress_rounds) {
+        bool ok = stress_thread_pool(std::max(4u, std::thread::hardware_concurrency()), stress_rounds);
+        std::cout << "thread pool stress, " << stress_rounds << " jobs: " << (ok ? "ok" : "FAILED") << std::endl;
+        return ok ? 0 : 1;
+    }
 
+    if (lazy_rounds) {
+        bool ok = check_lazy(lazy_rounds);
+        std::cout << "lazy sums, " << lazy_rounds << " shapes: " << (ok ? "ok" : "FAILED") << std::endl;
+        return ok ? 0 : 1;
+    }
 
-//    m3.print();
+    std::ofstream csv;
+    if (!csv_path.empty()) {
+        csv.open(csv_path);
+        if (!csv) {
+            std::cerr << "cannot open " << csv_path << std::endl;
+            return 1;
+        }
+        csv << "dtype,block_size,shape,m,k,n,threads,config,mc,kc,nc,median_ms,min_ms,gops,"
+               "ops_per_byte,achieved_gbps,stream_gbps,peak_gops,roofline_gops,imbalance\n";
+    }
 
+    const GemmConfig tuned = Matrix<int>::get_gemm_config();
+    GemmConfig half_kc = tuned;
+    half_kc.kc = std::max(1, tuned.kc / 2);
+    GemmConfig double_kc = tuned;
+    double_kc.kc = tuned.kc * 2;
+    const std::pair<const char*, GemmConfig> configs[] = {{"tuned", tuned}, {"half_kc", half_kc},
+                                                          {"double_kc", double_kc}};
+
+    std::cout << "block " << block_size << "x" << block_size << ", " << repeat << " runs each\n";
+    for (int threads : thread_cnts) {
+        ThreadPool pool(static_cast<size_t>(std::max(1, threads)), true);
+        const double stream_gbps = measure_bandwidth(pool) * 1e-9;
+        const double peak_gops = measure_peak_ops<int, int>(pool) * 1e-9;
+        std::cout << threads << " threads: triad " << stream_gbps << " GB/s, kernel peak " << peak_gops
+                  << " GOPS" << std::endl;
+
+        for (int size : sizes) {
+            // same number of multiply-adds in every shape
+            const BenchmarkShape shapes[] = {{"square", size, size, size},
+                                             {"tall_skinny", 4 * size, size, std::max(1, size / 4)},
+                                             {"fat", std::max(1, size / 4), size, 4 * size}};
+
+            for (auto& shape : shapes) {
+                for (auto& [config_name, config] : configs) {
+                    Matrix<int>::set_gemm_config(config);
+                    BenchmarkResult result = benchmark<int>(shape, pool, repeat);
+
+                    double ops = 2.0 * shape.m * shape.k * shape.n;
+                    double gops = ops / result.median_seconds * 1e-9;
+                    double traffic = gemm_traffic_bytes<int, int>(shape.m, shape.k, shape.n, config);
+                    double intensity = ops / traffic;
+                    double achieved_gbps = traffic / result.median_seconds * 1e-9;
+                    double roofline_gops = std::min(peak_gops, intensity * stream_gbps);
+
+                    std::cout << shape.name << ' ' << shape.m << 'x' << shape.k << 'x' << shape.n << ", "
+                              << threads << " threads, " << config_name << ": " << result.median_seconds * 1e3
+                              << " ms, " << gops << " GOPS of " << roofline_gops << " roofline ("
+                              << intensity << " ops/byte, " << achieved_gbps << " of " << stream_gbps
+                              << " GB/s), imbalance " << result.imbalance << std::endl;
+                    if (csv) {
+                        csv << "int32," << block_size << ',' << shape.name << ',' << shape.m << ',' << shape.k << ','
+                            << shape.n << ',' << threads << ',' << config_name << ',' << config.mc << ','
+                            << config.kc << ',' << config.nc << ',' << result.median_seconds * 1e3 << ','
+                            << result.min_seconds * 1e3 << ',' << gops << ',' << intensity << ',' << achieved_gbps
+                            << ',' << stream_gbps << ',' << peak_gops << ',' << roofline_gops << ','
+                            << result.imbalance << '\n';
+                    }
+                }
+            }
+        }
+    }
+    Matrix<int>::set_gemm_config(tuned);
 
     return 0;
 }